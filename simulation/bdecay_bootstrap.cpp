@@ -0,0 +1,186 @@
+//********************************************************************
+// Poisson bootstrap of the fits of the beta decay spectrum
+// Uses a pre-existing beta decay spectrum
+//
+// Each replica of the dataset gives every event a Poisson(1) weight. In a
+// bin of n events the sum of the weights is Poisson(n), so the replicas
+// of a histogram are drawn bin by bin without the event list. The draws
+// come from a counter-based generator (bdecay_rng.h), one stream per
+// (replica, bin), so all nboot replicas are filled in one pass into a
+// replica x bin array, in parallel, and do not depend on the number of
+// threads. Every replica is then fitted with BetaFitter, in parallel, and
+// the spread of the fitted parameters is compared with the fit errors.
+//
+// To run, do <root -l 'bdecay_bootstrap.cpp("filename")'>
+// Output (in filename_boot.root): TH1D m2_boot, C_boot, Q_boot of the
+// fitted parameters of the replicas
+//********************************************************************
+
+// C++ libs
+#include <iostream>
+#include<stdlib.h>	//rand, srand
+#include<cmath>
+#include<vector>
+#include<thread>
+
+// ROOT libs
+#include<TH1D.h>
+#include<TFile.h>
+#include<TMath.h>
+#include<TParameter.h>
+#include<TStopwatch.h>
+
+using namespace std;
+
+////////////////// Parameters ///////////////////////
+// Initial nucleus
+const int Z_1 = 1;	// Atomic number of initial nucleus (3H)
+const double m_1 = 3.0160492;	// Isotope mass (in atomic mass units)
+
+// Final nucleus
+const int Z_2 = 2;	// Atomic number of final nucleus (3He)
+const double m_2 = 3.0160293;	// Isotope mass (in atomic mass units)
+
+// Other parameters
+const int charge = -1;
+const double Q = 18590; // Katrin Q Value (in eV)
+const string histname = "E_e_sm";	// Histogram to resample
+const double fitmin = Q-25;	// Lower edge of the fit range (relative to the generator Q, as in bdecay_plot.cpp), raised to GenInfo::FitMin
+const double fitmax = Q-0.2;	// Upper edge of the fit range
+const bool freeQ = false;	// Fit the endpoint Q too
+const int nboot = 1000;	// Number of bootstrap replicas
+const unsigned long seed = 4357;	// Seed of the replicas
+const int nthreads = 0;	// Number of threads (0 = number of cores)
+////////////////// End Of Parameters ///////////////
+
+// Physical Constants
+const double Pi = 3.14159265;	// Pi
+const double alpha = 1./137;	// Structure constant
+const double m_e = 0.510998910e6;	// Mass (in eV) of electron. From Wikipedia.
+
+// Spectrum kernels, generic over the scalar type (needs the constants above)
+#include "bdecay_spectrum.h"
+#include "bdecay_fit.h"
+#include "bdecay_rng.h"
+
+// Main program
+void bdecay_bootstrap(string filename){
+	int nth = nthreads>0 ? nthreads : max(1u, thread::hardware_concurrency());
+
+	// ROOT rootfile
+	TFile *rootfile = new TFile((filename + ".root").c_str(), "read");
+	TH1D *h = (TH1D*)rootfile->Get(histname.c_str());
+	GenInfo gen = ReadGenInfo(rootfile, Q, h->GetXaxis()->GetXmin());
+	double Q_0 = gen.Q_0, res = gen.res;
+	string error;
+	SpectrumModel model;
+	if (!model.Init(gen, h->GetXaxis()->GetXmin(), h->GetXaxis()->GetXmax(), error)) {
+		cout << filename << ".root: " << error << endl;
+		return;
+	}
+	if (gen.corrections != "") cout << "Corrections: " << gen.corrections << endl;
+	if (gen.isotope != "") cout << "Isotope: " << gen.isotope << endl;
+
+	// Event counts of the bins in the fit range
+	double lo = gen.FitMin(fitmin-Q+Q_0, res), hi = fitmax-Q+Q_0;
+	if (lo > fitmin-Q+Q_0) cout << "Fit from " << lo << " eV: the generation starts at " << gen.limit << " eV, and the folding reaches " << foldsigma << " res below the fit range" << endl;
+	vector<double> x, n;
+	for (int i=1; i<=h->GetNbinsX(); i++) {
+		double xi = h->GetBinCenter(i);
+		if (xi < lo || xi > hi) continue;
+		x.push_back(xi);
+		n.push_back(gen.Counts(h->GetBinContent(i)));
+	}
+	int nbins = x.size();
+
+	// Fit of the data, starting point of the replica fits
+	vector<double> err(nbins);
+	for (int i=0; i<nbins; i++) err[i] = sqrt(n[i]);
+	BetaFitter fitter;
+	fitter.SetData(nbins, &x[0], &n[0], &err[0]);
+	fitter.SetFolding(res);
+	model.Apply(fitter);	// The replica fitters copy its pointers to the tables
+	fitter.SetParameter(BetaFitter::M2, 0.);
+	fitter.SetParameter(BetaFitter::C, StartC(model, x, n, 0., Q_0, res));
+	fitter.SetParameter(BetaFitter::Q_E, Q_0, !freeQ);
+	fitter.Fit();
+	cout << "Data: m_nu^2 = " << fitter.par[BetaFitter::M2] << " +- " << fitter.err[BetaFitter::M2] << " eV^2";
+	if (freeQ) cout << ", Q = " << fitter.par[BetaFitter::Q_E] << " +- " << fitter.err[BetaFitter::Q_E] << " eV";
+	cout << ", ChiSq = " << fitter.chi2 << " for " << fitter.ndf << " degrees of freedom" << endl;
+
+	// Replicas: row r of the replica x bin array is replica r
+	TStopwatch sw;
+	sw.Start();
+	vector<double> reps((long)nboot*nbins);
+	vector<thread> threads;
+	for (int t=0; t<nth; t++) {
+		threads.push_back(thread([&, t]() {
+			for (int r=t; r<nboot; r+=nth) {
+				double *row = &reps[(long)r*nbins];
+				for (int i=0; i<nbins; i++) row[i] = CounterRng(seed, r, i).Poisson(n[i]);
+			}
+		}));
+	}
+	for (int t=0; t<nth; t++) threads[t].join();
+	double t_draw = sw.RealTime();
+
+	// Fits of the replicas, warm-started from the fit of the data. Each thread has its own fitter
+	sw.Start();
+	vector<double> result((long)nboot*BetaFitter::NPAR, 0.);
+	vector<int> status(nboot, 0);
+	threads.clear();
+	for (int t=0; t<nth; t++) {
+		threads.push_back(thread([&, t]() {
+			BetaFitter f = fitter;
+			vector<double> e(nbins);
+			for (int r=t; r<nboot; r+=nth) {
+				double *row = &reps[(long)r*nbins];
+				for (int i=0; i<nbins; i++) e[i] = sqrt(row[i]);
+				f.SetData(nbins, &x[0], row, &e[0]);
+				for (int k=0; k<BetaFitter::NPAR; k++) f.SetParameter(k, fitter.par[k], fitter.fixed[k]);
+				status[r] = f.Fit();
+				for (int k=0; k<BetaFitter::NPAR; k++) result[(long)r*BetaFitter::NPAR+k] = f.par[k];
+			}
+		}));
+	}
+	for (int t=0; t<nth; t++) threads[t].join();
+	double t_fit = sw.RealTime();
+
+	// ROOT Histograms of the fitted parameters
+	double e_m2 = fitter.err[BetaFitter::M2], e_C = fitter.err[BetaFitter::C], e_Q = max(fitter.err[BetaFitter::Q_E], 1e-3);
+	TH1D *m2_boot = new TH1D("m2_boot", ";m_{#nu}^{2} [eV^{2}];Replicas", 100, fitter.par[BetaFitter::M2]-5*e_m2, fitter.par[BetaFitter::M2]+5*e_m2);
+	TH1D *C_boot = new TH1D("C_boot", ";C;Replicas", 100, fitter.par[BetaFitter::C]-5*e_C, fitter.par[BetaFitter::C]+5*e_C);
+	TH1D *Q_boot = new TH1D("Q_boot", ";Q [eV];Replicas", 100, fitter.par[BetaFitter::Q_E]-5*e_Q, fitter.par[BetaFitter::Q_E]+5*e_Q);
+	int nfail = 0;
+	double mean[BetaFitter::NPAR] = {0}, mean2[BetaFitter::NPAR] = {0};	// Moments of the parameters, over all converged replicas
+	for (int r=0; r<nboot; r++) {
+		if (status[r] != 0) {
+			nfail++;
+			continue;
+		}
+		const double *p = &result[(long)r*BetaFitter::NPAR];
+		m2_boot->Fill(p[BetaFitter::M2]);
+		C_boot->Fill(p[BetaFitter::C]);
+		Q_boot->Fill(p[BetaFitter::Q_E]);
+		for (int k=0; k<BetaFitter::NPAR; k++) {
+			mean[k] += p[k];
+			mean2[k] += p[k]*p[k];
+		}
+	}
+	double sigma[BetaFitter::NPAR];
+	for (int k=0; k<BetaFitter::NPAR; k++) {
+		int nok = max(nboot-nfail, 2);
+		mean[k] /= nok;
+		sigma[k] = sqrt(max(mean2[k]/nok - mean[k]*mean[k], 0.)*nok/(nok-1));
+	}
+
+	cout << nboot << " replicas of " << nbins << " bins drawn in " << 1e3*t_draw << " ms and fitted in " << t_fit << " s on " << nth << " threads (" << nfail << " fits did not converge)" << endl;
+	cout << "Bootstrap: sigma(m_nu^2) = " << sigma[BetaFitter::M2] << " eV^2 (fit error " << e_m2 << "), mean " << mean[BetaFitter::M2] << endl;
+	if (freeQ) cout << "Bootstrap: sigma(Q) = " << sigma[BetaFitter::Q_E] << " eV (fit error " << e_Q << "), mean " << mean[BetaFitter::Q_E] << endl;
+
+	TFile *outfile = new TFile((filename + "_boot.root").c_str(), "recreate");
+	m2_boot->Write();
+	C_boot->Write();
+	Q_boot->Write();
+	outfile->Close();
+}
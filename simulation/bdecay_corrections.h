@@ -0,0 +1,229 @@
+//********************************************************************
+// Spectral corrections beyond the Fermi function, tabulated once
+//
+// Each correction is a multiplicative factor of N(T_e) declared once as a
+// Correction: Factor(T_e) may be expensive (dilogarithms, powers), it is
+// never called in a hot loop. A CorrectionStack is the list of enabled
+// terms, and a CorrectionTable is their product tabulated on a fine grid
+// over the window, so the generator and the fits pay one linear
+// interpolation per call however many terms are enabled.
+//
+// Terms (W = total electron energy in units of m_e, W0 at the endpoint):
+//   radiative	outer radiative correction 1 + alpha/2pi g(W, W0) of Sirlin,
+//		with the log divergence at the endpoint resummed
+//   screening	atomic screening of Rose, potential V0 = 1.45 alpha^2 Z^(4/3)
+//   finitesize	finite nuclear size: L0 and the shape factor C of Wilkinson
+//   recoil	recoil of the 3He nucleus, to first order in 1/M
+//   wm		weak magnetism and V-A interference, to first order in 1/M
+// The recoil and weak magnetism terms use lambda = g_A M_GT/M_F and the
+// isovector magnetic moment of the 3H - 3He transition, so they are
+// refused for any other decay; screening and finitesize use the charge Z
+// and mass number A of the daughter (3He by default). The endpoint
+// dependent terms are tabulated at one Q_0.
+//
+// The fits read back the corrections of a generation from its file
+// (TNamed "corrections", see bdecay_sim.cpp) through SpectrumModel
+// (bdecay_fit.h).
+//
+// Include this file after the parameter block of the macro: it uses
+// Z_2, m_e, alpha and Pi from there.
+//********************************************************************
+
+#ifndef BDECAY_CORRECTIONS_H
+#define BDECAY_CORRECTIONS_H
+
+#include<cmath>
+#include<memory>
+#include<sstream>
+#include<string>
+#include<vector>
+
+class Correction {
+public:
+	virtual ~Correction() {}
+	virtual const char* Name() const = 0;
+	virtual double Factor(double T_e) const = 0;	// Multiplicative factor at the kinetic energy T_e (in eV)
+
+protected:
+	static double W(double T_e) { return 1 + T_e/m_e; }
+	static double P(double W) { return sqrt(std::max(W*W - 1, 0.)); }
+};
+
+// Dilogarithm Li2(x) for 0 <= x <= 1
+inline double dilog(double x)
+{
+	if (x > 0.5) return Pi*Pi/6 - log(x)*log(1-x) - dilog(1-x);	// Reflection, so that the series converges fast
+	double sum = 0, xk = x;
+	for (int k=1; k<200 && xk > 1e-17*k*k; k++, xk *= x) sum += xk/(k*k);
+	return sum;
+}
+
+// Outer radiative correction, Sirlin, Phys. Rev. 164 (1967) 1767, with ((W0-W)/m_e)^(2 alpha/pi t) resummed (Repko & Wu 1983)
+class RadiativeCorrection : public Correction {
+public:
+	explicit RadiativeCorrection(double Q_0) : W0(W(Q_0)) {}
+	const char* Name() const { return "radiative"; }
+	double Factor(double T_e) const {
+		double w = W(T_e), b = P(w)/w, d = std::max(W0 - w, 0.);
+		if (b <= 0) return 1.;
+		double a = atanh(b), t = a/b - 1;
+		const double m_p = 938.272046e6;	// Mass (in eV) of proton
+		double g = 3*log(m_p/m_e) - 0.75 + 4*t*(d/(3*w) - 1.5) - (4/b)*dilog(2*b/(1+b)) + (a/b)*(2*(1+b*b) + d*d/(6*w*w) - 4*a);	// g without the log(2(W0-W)) term
+		double resummed = d > 0 ? pow(2*d, 2*alpha/Pi*t) : 1.;	// Taken as 1 at the endpoint itself, where N() vanishes
+		return resummed * (1 + alpha/(2*Pi)*g);
+	}
+
+private:
+	double W0;
+};
+
+// Atomic screening, Rose, Phys. Rev. 49 (1936) 727, with gamma = 1 in the ratio of the Gamma functions (light nuclei)
+class ScreeningCorrection : public Correction {
+public:
+	explicit ScreeningCorrection(int Z_=Z_2) : Z(Z_), V0(1.45*alpha*alpha*pow(double(Z_), 4./3)) {}
+	const char* Name() const { return "screening"; }
+	double Factor(double T_e) const {
+		double w = W(T_e), ws = w - V0;
+		if (ws <= 1) return 0.;
+		double p = P(w), ps = P(ws);
+		double eta = alpha*Z*w/p, etas = alpha*Z*ws/ps;
+		double g = sqrt(1 - alpha*Z*alpha*Z);
+		return ws/w * pow(ps/p, 2*g-1) * exp(Pi*(etas-eta)) * etas/eta * sinh(Pi*eta)/sinh(Pi*etas);	// |Gamma(1+i eta)|^2 = pi eta/sinh(pi eta)
+	}
+
+private:
+	int Z;
+	double V0;	// Screening potential (in units of m_e)
+};
+
+// Finite nuclear size: L0 and the shape factor C of an allowed transition, Wilkinson, Nucl. Instr. Meth. A 290 (1990) 509
+class FiniteSizeCorrection : public Correction {
+public:
+	FiniteSizeCorrection(double Q_0, double R_fm=1.76*sqrt(5./3), int Z_=Z_2) : W0(W(Q_0)), R(R_fm/386.15926), Z(Z_) {}	// R: radius of the uniformly charged sphere (3He rms radius 1.76 fm)
+	const char* Name() const { return "finitesize"; }
+	double Factor(double T_e) const {
+		double w = W(T_e), aZ = alpha*Z, g = sqrt(1 - aZ*aZ);
+		double L0 = 1 + 13*aZ*aZ/60 - aZ*w*R*(41-26*g)/(15*(2*g-1)) - aZ*R*g*(17-2*g)/(30*w*(2*g-1));
+		double C0 = -233*aZ*aZ/630 - W0*R*W0*R/5 + 2*aZ*W0*R/35, C1 = -21*aZ*R/35 + 4*W0*R*R/9, C2 = -4*R*R/9;
+		return L0 * (1 + C0 + C1*w + C2*w*w);
+	}
+
+private:
+	double W0;
+	double R;	// Nuclear radius (in units of hbar/(m_e c))
+	int Z;
+};
+
+// Recoil-order terms of the 3H decay, Simkovic et al., Phys. Rev. C 77 (2008) 055502: 1 + (A W - B/W)/(1 + 3 lambda^2),
+// A = 2(5 lambda^2 + lambda mu + 1)/M, B = 2 lambda (mu + lambda)/M. RecoilCorrection is mu = 0, WeakMagnetismCorrection the ratio to it
+inline double recoil_factor(double w, double lambda, double mu, double M)
+{
+	double A = 2*(5*lambda*lambda + lambda*mu + 1)/M, B = 2*lambda*(mu + lambda)/M;
+	return 1 + (A*w - B/w)/(1 + 3*lambda*lambda);
+}
+
+class RecoilCorrection : public Correction {
+public:
+	RecoilCorrection(double lambda_=1.2646, double M_=2808.391e6) : lambda(lambda_), M(M_/m_e) {}	// M: 3He nuclear mass (in eV)
+	const char* Name() const { return "recoil"; }
+	double Factor(double T_e) const { return recoil_factor(W(T_e), lambda, 0., M); }
+
+private:
+	double lambda, M;
+};
+
+class WeakMagnetismCorrection : public Correction {
+public:
+	WeakMagnetismCorrection(double lambda_=1.2646, double mu_=5.107, double M_=2808.391e6) : lambda(lambda_), mu(mu_), M(M_/m_e) {}	// mu: mu(3H) - mu(3He), in nuclear magnetons
+	const char* Name() const { return "wm"; }
+	double Factor(double T_e) const {
+		double w = W(T_e);
+		return recoil_factor(w, lambda, mu, M)/recoil_factor(w, lambda, 0., M);
+	}
+
+private:
+	double lambda, mu, M;
+};
+
+// Enabled corrections
+class CorrectionStack {
+public:
+	void Add(Correction *c) { terms.push_back(std::shared_ptr<const Correction>(c)); }
+
+	// Add the terms of a comma-separated list of names (see above) for a daughter nucleus (Z, A).
+	// Returns false, with a message, on an unknown name or a term that does not apply to the decay
+	bool Add(const std::string &list, double Q_0, std::string &error, int Z=Z_2, int A=3) {
+		bool tritium = Z == 2 && A == 3;
+		double R_fm = tritium ? 1.76*sqrt(5./3) : 1.2*pow(double(A), 1./3);	// Uniformly charged sphere: 3He rms radius, or 1.2 A^(1/3) fm
+		std::stringstream ss(list);
+		std::string name;
+		while (std::getline(ss, name, ',')) {
+			if (name == "") continue;
+			else if ((name == "recoil" || name == "wm") && !tritium) {
+				error = "correction " + name + " is only for the 3H decay";
+				return false;
+			}
+			else if (name == "radiative") Add(new RadiativeCorrection(Q_0));
+			else if (name == "screening") Add(new ScreeningCorrection(Z));
+			else if (name == "finitesize") Add(new FiniteSizeCorrection(Q_0, R_fm, Z));
+			else if (name == "recoil") Add(new RecoilCorrection());
+			else if (name == "wm") Add(new WeakMagnetismCorrection());
+			else {
+				error = "unknown correction " + name;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	double Factor(double T_e) const {
+		double f = 1;
+		for (size_t i=0; i<terms.size(); i++) f *= terms[i]->Factor(T_e);
+		return f;
+	}
+
+	size_t Size() const { return terms.size(); }
+	const Correction& Term(size_t i) const { return *terms[i]; }
+
+private:
+	std::vector< std::shared_ptr<const Correction> > terms;
+};
+
+// Product of the corrections of a stack on n intervals over [lo, hi], linearly interpolated. Outside the window the edge values are used
+struct CorrectionTable {
+	double lo, hi;	// Window
+	double step;	// Grid step
+	std::vector<double> v;	// Product at lo + i*step, i = 0..n
+	double vmax;	// Largest value, for Von Neumann bounds
+	double maxerr;	// Maximum relative error of the interpolation, measured at the midpoints
+
+	CorrectionTable() : lo(0), hi(0), step(1), vmax(1), maxerr(0) {}
+
+	void Init(const CorrectionStack &stack, double lo_, double hi_, int n) {
+		lo = lo_;
+		hi = hi_;
+		step = (hi-lo)/n;
+		v.resize(n+1);
+		for (int i=0; i<=n; i++) v[i] = stack.Factor(lo + i*step);
+		vmax = 0;
+		for (int i=0; i<=n; i++) vmax = std::max(vmax, v[i]);
+		maxerr = 0;
+		for (int i=0; i<n; i++) {
+			double f = stack.Factor(lo + (i+0.5)*step);
+			if (f > 0) maxerr = std::max(maxerr, fabs(0.5*(v[i]+v[i+1])/f - 1));
+		}
+	}
+
+	bool Empty() const { return v.empty(); }
+
+	double Eval(double T_e) const {
+		double x = (T_e - lo)/step;
+		if (x <= 0) return v[0];
+		int i = int(x);
+		if (i >= int(v.size())-1) return v.back();
+		return v[i] + (x-i)*(v[i+1]-v[i]);
+	}
+	double operator()(double T_e) const { return Eval(T_e); }
+};
+
+#endif
@@ -0,0 +1,65 @@
+//********************************************************************
+// Forward-mode dual numbers for the beta decay spectrum kernels
+//
+// A Dual<n> carries a value together with its partial derivatives with
+// respect to n seeded parameters. Evaluating N_gen() or Nfold_gen() (see
+// bdecay_spectrum.h) with Dual<n> arguments gives the exact gradient in the
+// same pass as the value, with no finite differences.
+//
+// Usage: Dual<2> m_nu2 = Dual<2>::Var(0.04, 0);	// d/d(m_nu^2) is slot 0
+//        Dual<2> C = Dual<2>::Var(1., 1);	// d/dC is slot 1
+//********************************************************************
+
+#ifndef BDECAY_DUAL_H
+#define BDECAY_DUAL_H
+
+#include<cmath>
+
+template<int n>
+struct Dual {
+	double val;	// Value
+	double d[n];	// Partial derivatives with respect to the n seeded parameters
+
+	Dual(double v=0) : val(v) { for (int i=0; i<n; i++) d[i]=0; }
+
+	// Independent variable number i (its own derivative is 1)
+	static Dual Var(double v, int i) { Dual x(v); x.d[i]=1; return x; }
+
+	Dual& operator+=(const Dual &b) { val+=b.val; for (int i=0; i<n; i++) d[i]+=b.d[i]; return *this; }
+	Dual& operator-=(const Dual &b) { val-=b.val; for (int i=0; i<n; i++) d[i]-=b.d[i]; return *this; }
+	Dual& operator*=(const Dual &b) { for (int i=0; i<n; i++) d[i]=d[i]*b.val+val*b.d[i]; val*=b.val; return *this; }
+	Dual& operator/=(const Dual &b) { double inv=1./b.val; for (int i=0; i<n; i++) d[i]=(d[i]-val*inv*b.d[i])*inv; val*=inv; return *this; }
+};
+
+// Value part, so that the kernels can branch identically on double and Dual
+inline double value(double x) { return x; }
+template<int n> inline double value(const Dual<n> &x) { return x.val; }
+
+// Arithmetic
+template<int n> inline Dual<n> operator-(Dual<n> a) { a.val=-a.val; for (int i=0; i<n; i++) a.d[i]=-a.d[i]; return a; }
+template<int n> inline Dual<n> operator+(Dual<n> a, const Dual<n> &b) { return a+=b; }
+template<int n> inline Dual<n> operator-(Dual<n> a, const Dual<n> &b) { return a-=b; }
+template<int n> inline Dual<n> operator*(Dual<n> a, const Dual<n> &b) { return a*=b; }
+template<int n> inline Dual<n> operator/(Dual<n> a, const Dual<n> &b) { return a/=b; }
+template<int n> inline Dual<n> operator+(Dual<n> a, double b) { a.val+=b; return a; }
+template<int n> inline Dual<n> operator+(double b, Dual<n> a) { a.val+=b; return a; }
+template<int n> inline Dual<n> operator-(Dual<n> a, double b) { a.val-=b; return a; }
+template<int n> inline Dual<n> operator-(double b, const Dual<n> &a) { return b + (-a); }
+template<int n> inline Dual<n> operator*(Dual<n> a, double b) { a.val*=b; for (int i=0; i<n; i++) a.d[i]*=b; return a; }
+template<int n> inline Dual<n> operator*(double b, Dual<n> a) { return a*b; }
+template<int n> inline Dual<n> operator/(Dual<n> a, double b) { return a*(1./b); }
+template<int n> inline Dual<n> operator/(double b, const Dual<n> &a) { return Dual<n>(b)/a; }
+
+// Elementary functions: f(a) with derivative f'(a)*da
+template<int n> inline Dual<n> chain(const Dual<n> &a, double f, double df)
+{
+	Dual<n> r(f);
+	for (int i=0; i<n; i++) r.d[i]=df*a.d[i];
+	return r;
+}
+template<int n> inline Dual<n> sqrt(const Dual<n> &a) { double s=std::sqrt(a.val); return chain(a, s, 0.5/s); }
+template<int n> inline Dual<n> exp(const Dual<n> &a) { double e=std::exp(a.val); return chain(a, e, e); }
+template<int n> inline Dual<n> log(const Dual<n> &a) { return chain(a, std::log(a.val), 1./a.val); }
+template<int n> inline Dual<n> pow(const Dual<n> &a, double p) { double q=std::pow(a.val,p-1); return chain(a, q*a.val, p*q); }
+
+#endif
@@ -0,0 +1,369 @@
+//********************************************************************
+// Fit engine pieces shared by the fitting macros
+//
+// CovChi2: chi-square r^T V^-1 r with a full covariance matrix V. V is
+// factorized once (V = L L^T) and every evaluation is a single forward
+// substitution L y = r, chi2 = |y|^2, i.e. O(n^2) instead of O(n^3).
+//
+// BetaFitter: Levenberg-Marquardt least-squares fit of the beta spectrum
+// model mu(x) = C N(x; m_nu^2, Q) + B to binned data, optionally with N
+// folded with the resolution. The Jacobian is exact (dual numbers, see
+// bdecay_spectrum.h), the Hessian is the Gauss-Newton J^T W J, and the fit
+// allocates nothing after SetData(), so it can run in-process in loops.
+// The model can include tabulated spectral corrections (SetCorrections),
+// and be the spectrum of another isotope (SetShape, bdecay_shape.h).
+//
+// SpectrumModel: the model of a generation as recorded in its file, set
+// up once by the fitting macros and shared by BetaFitter and their TF1.
+// ReadGenInfo reads what bdecay_sim recorded about the generation, and
+// StartC gives the common starting value of C of the fits.
+// Include this file after bdecay_spectrum.h.
+//********************************************************************
+
+#ifndef BDECAY_FIT_H
+#define BDECAY_FIT_H
+
+#include<cmath>
+#include<string>
+#include<vector>
+
+#include<TFile.h>
+#include<TParameter.h>
+#include<TNamed.h>
+
+#include "bdecay_corrections.h"
+#include "bdecay_shape.h"
+
+struct CovChi2 {
+	int n;	// Number of bins
+	std::vector<double> L;	// Lower Cholesky factor, packed by rows: row i starts at i*(i+1)/2
+	std::vector<double> inv_diag;	// 1/L_ii
+	mutable std::vector<double> y;	// Work space of the forward substitution
+
+	CovChi2() : n(0) {}
+
+	// Factorize the symmetric positive definite n x n matrix V (row-major). Returns false if V is not positive definite
+	bool Factor(const std::vector<double> &V, int nbins) {
+		n = nbins;
+		L.assign(n*(n+1)/2, 0.);
+		inv_diag.assign(n, 0.);
+		y.assign(n, 0.);
+		for (int i=0; i<n; i++) {
+			double *Li = &L[i*(i+1)/2];
+			for (int j=0; j<=i; j++) {
+				const double *Lj = &L[j*(j+1)/2];
+				double s = V[i*n+j];
+				for (int k=0; k<j; k++) s -= Li[k]*Lj[k];	// Contiguous dot product of two rows
+				if (j < i) {
+					Li[j] = s*inv_diag[j];
+				}
+				else {
+					if (s <= 0) return false;
+					Li[i] = sqrt(s);
+					inv_diag[i] = 1./Li[i];
+				}
+			}
+		}
+		return true;
+	}
+
+	// r^T V^-1 r for the residual vector r
+	double Eval(const double *r) const {
+		double chi2 = 0;
+		for (int i=0; i<n; i++) {
+			const double *Li = &L[i*(i+1)/2];
+			double s = r[i];
+			for (int k=0; k<i; k++) s -= Li[k]*y[k];	// Contiguous dot product, vectorized by the compiler
+			y[i] = s*inv_diag[i];
+			chi2 += y[i]*y[i];
+		}
+		return chi2;
+	}
+};
+
+class BetaFitter {
+public:
+	enum { M2, C, Q_E, B, NPAR };	// Parameters: m_nu^2, normalization, endpoint, flat background
+
+	BetaFitter() : res(0), corr(0), shape(0), lambda(1e-3), chi2(0), ndf(0), niter(0) {
+		for (int i=0; i<NPAR; i++) {
+			par[i] = 0;
+			err[i] = 0;
+			fixed[i] = false;
+		}
+		fixed[Q_E] = fixed[B] = true;
+	}
+
+	// Bins with err <= 0 are ignored, as empty bins in TH1::Fit
+	void SetData(int n, const double *x_, const double *y_, const double *err_) {
+		x.clear();
+		y.clear();
+		w.clear();
+		for (int i=0; i<n; i++) {
+			if (err_[i] <= 0) continue;
+			x.push_back(x_[i]);
+			y.push_back(y_[i]);
+			w.push_back(1./(err_[i]*err_[i]));
+		}
+		J.resize(x.size()*NPAR);
+		r.resize(x.size());
+	}
+
+	void SetFolding(double res_) { res = res_; }	// Resolution of the folded model (0 = no folding)
+	void SetCorrections(const CorrectionTable *corr_) { corr = corr_; }	// Spectral corrections of the model, held by the caller (0 = none)
+	void SetShape(const ShapeSpectrum *shape_) { shape = shape_; }	// Spectrum of another isotope instead of N() (0 = tritium), held by the caller
+	void SetParameter(int i, double v, bool fix=false) { par[i] = v; fixed[i] = fix; }
+
+	// Minimize the chi-square. Returns 0 if converged. With m_nu^2 and Q both free, m_nu^2 is first fitted at the starting Q:
+	// the two are strongly correlated, and from a distant m_nu^2 (e.g. 0 for the 187Re spectrum) the joint fit can end in a spurious minimum
+	int Fit(int maxiter=100, double tol=1e-8) {
+		if (fixed[M2] || fixed[Q_E]) return Minimize(maxiter, tol);
+		fixed[Q_E] = true;
+		Minimize(maxiter, tol);
+		int n = niter;
+		fixed[Q_E] = false;
+		int status = Minimize(maxiter, tol);
+		niter += n;
+		return status;
+	}
+
+	double par[NPAR], err[NPAR], cov[NPAR][NPAR];
+	bool fixed[NPAR];
+	double res;	// Resolution of the folded model
+	const CorrectionTable *corr;	// Tabulated spectral corrections (0 = none)
+	const ShapeSpectrum *shape;	// Isotope spectrum (0 = N())
+	double lambda;	// Marquardt damping
+	double chi2;
+	int ndf, niter;
+
+private:
+	std::vector<double> x, y, w;	// Bin centers, contents and weights 1/err^2
+	std::vector<double> J;	// Jacobian d mu_i/d par_k
+	std::vector<double> r;	// Residuals y - mu
+
+	// Levenberg-Marquardt iterations in the free parameters, then their errors
+	int Minimize(int maxiter, double tol) {
+		int free[NPAR], nfree = 0;
+		for (int i=0; i<NPAR; i++) if (!fixed[i]) free[nfree++] = i;
+		ndf = x.size() - nfree;
+		double A[NPAR*NPAR], b[NPAR], step[NPAR], trial[NPAR];
+		chi2 = Eval(par, true);
+		Normal(free, nfree, A, b);
+		lambda = 1e-3;
+		int status = 1;
+		for (niter=0; niter<maxiter; niter++) {
+			// Damped Gauss-Newton step (A + lambda diag(A)) step = b, in the free parameters
+			double M[NPAR*NPAR];
+			for (int i=0; i<nfree*nfree; i++) M[i] = A[i];
+			for (int i=0; i<nfree; i++) M[i*nfree+i] *= 1 + lambda;
+			if (!Solve(M, b, step, nfree)) break;
+			for (int i=0; i<NPAR; i++) trial[i] = par[i];
+			for (int i=0; i<nfree; i++) trial[free[i]] += step[i];
+			double chi2_trial = Eval(trial, false);
+			if (chi2_trial <= chi2) {	// Accepted: move towards Gauss-Newton
+				double change = chi2 - chi2_trial;
+				for (int i=0; i<NPAR; i++) par[i] = trial[i];
+				chi2 = Eval(par, true);
+				Normal(free, nfree, A, b);
+				lambda = std::max(lambda*0.1, 1e-12);
+				if (change <= tol*(1+chi2)) {
+					status = 0;
+					break;
+				}
+			}
+			else {	// Rejected: move towards gradient descent with a shorter step
+				lambda *= 10;
+				if (lambda > 1e12) break;
+			}
+		}
+
+		// Errors from the inverse of J^T W J
+		for (int i=0; i<NPAR; i++) {
+			err[i] = 0;
+			for (int j=0; j<NPAR; j++) cov[i][j] = 0;
+		}
+		for (int j=0; j<nfree; j++) {
+			double e[NPAR] = {0}, col[NPAR], M[NPAR*NPAR];
+			e[j] = 1;
+			for (int i=0; i<nfree*nfree; i++) M[i] = A[i];
+			if (!Solve(M, e, col, nfree)) return 2;
+			for (int i=0; i<nfree; i++) cov[free[i]][free[j]] = col[i];
+		}
+		for (int i=0; i<NPAR; i++) err[i] = sqrt(std::max(cov[i][i], 0.));
+		return status;
+	}
+
+	// Chi-square at p. With jac, also the residuals and the Jacobian
+	double Eval(const double *p, bool jac) {
+		typedef Dual<2> D;	// Derivatives with respect to m_nu^2 and Q
+		D m2 = D::Var(p[M2], 0), Q_0 = D::Var(p[Q_E], 1);
+		auto model = [&](const D &T_e) {
+			D n = shape ? shape->Eval<D>(T_e, m2, D(1.), Q_0) : N_gen<D>(T_e, m2, D(1.), Q_0);
+			return corr ? n*corr->Eval(value(T_e)) : n;
+		};
+		double sum = 0;
+		for (size_t i=0; i<x.size(); i++) {
+			D f = res > 0 ? fold_gen<D>(D(x[i]), D(res), model) : model(D(x[i]));
+			double ri = y[i] - (p[C]*f.val + p[B]);
+			sum += w[i]*ri*ri;
+			if (jac) {
+				r[i] = ri;
+				double *Ji = &J[i*NPAR];
+				Ji[M2] = p[C]*f.d[0];
+				Ji[C] = f.val;
+				Ji[Q_E] = p[C]*f.d[1];
+				Ji[B] = 1;
+			}
+		}
+		return sum;
+	}
+
+	// Normal equations of the free parameters: A = J^T W J, b = J^T W r
+	void Normal(const int *free, int nfree, double *A, double *b) const {
+		for (int k=0; k<nfree*nfree; k++) A[k] = 0;
+		for (int k=0; k<nfree; k++) b[k] = 0;
+		for (size_t i=0; i<x.size(); i++) {
+			const double *Ji = &J[i*NPAR];
+			for (int k=0; k<nfree; k++) {
+				double wJ = w[i]*Ji[free[k]];
+				b[k] += wJ*r[i];
+				for (int l=0; l<=k; l++) A[k*nfree+l] += wJ*Ji[free[l]];
+			}
+		}
+		for (int k=0; k<nfree; k++) for (int l=0; l<k; l++) A[l*nfree+k] = A[k*nfree+l];
+	}
+
+	// Solve M s = b for a small symmetric positive definite M (overwritten), with diagonal scaling for badly scaled parameters
+	static bool Solve(double *M, const double *b, double *s, int n) {
+		double d[NPAR], L[NPAR*NPAR], z[NPAR];
+		for (int i=0; i<n; i++) {
+			if (M[i*n+i] <= 0) return false;
+			d[i] = 1./sqrt(M[i*n+i]);
+		}
+		for (int i=0; i<n; i++) for (int j=0; j<n; j++) M[i*n+j] *= d[i]*d[j];
+		for (int i=0; i<n; i++) {
+			for (int j=0; j<=i; j++) {
+				double sum = M[i*n+j];
+				for (int k=0; k<j; k++) sum -= L[i*n+k]*L[j*n+k];
+				if (i == j) {
+					if (sum <= 0) return false;
+					L[i*n+i] = sqrt(sum);
+				}
+				else L[i*n+j] = sum/L[j*n+j];
+			}
+		}
+		for (int i=0; i<n; i++) {
+			double sum = b[i]*d[i];
+			for (int k=0; k<i; k++) sum -= L[i*n+k]*z[k];
+			z[i] = sum/L[i*n+i];
+		}
+		for (int i=n-1; i>=0; i--) {
+			double sum = z[i];
+			for (int k=i+1; k<n; k++) sum -= L[k*n+i]*s[k];
+			s[i] = sum/L[i*n+i];
+		}
+		for (int i=0; i<n; i++) s[i] *= d[i];
+		return true;
+	}
+};
+
+// Spectrum of a generation as recorded by bdecay_sim: N(), or the spectrum of the isotope of the shape sampler (TNamed
+// "isotope", empty = N()), times the spectral corrections (TNamed "corrections", empty = none)
+// What bdecay_sim recorded about the generation of a file
+struct GenInfo {
+	double Q_0, res;	// Generator endpoint and resolution (older files: the Q of the macro and no folding)
+	double limit;	// Lower edge of the generated true energies (older files: the lower edge of the histograms)
+	double livetime;	// Live time (in s) if the histograms are rates (generation driven by activity), 0 if they are counts
+	std::string corrections;	// Spectral corrections of the generation, fitted with the same model
+	std::string isotope;	// Isotope of the generation (empty = N())
+
+	GenInfo(double Q=0, double lo=0) : Q_0(Q), res(0), limit(lo), livetime(0) {}
+
+	// Event count of a bin of content y
+	double Counts(double y) const { return livetime > 0 ? floor(y*livetime + 0.5) : y; }
+
+	// Lower edge lo of a fit with the model folded with res, raised to limit + foldsigma*res: below, the folding
+	// reaches under limit, where the generation put no events, and the fit is biased
+	double FitMin(double lo, double res) const { return std::max(lo, limit + foldsigma*std::max(res, 0.)); }
+};
+
+// Generation of the ROOT file f. Q and lo (lower edge of its histograms) are assumed for files without the endpoint and limit
+inline GenInfo ReadGenInfo(TFile *f, double Q, double lo)
+{
+	GenInfo gen(Q, lo);
+	TParameter<double> *Q_gen = (TParameter<double>*)f->Get("Q");
+	TParameter<double> *res_gen = (TParameter<double>*)f->Get("res");
+	TParameter<double> *limit = (TParameter<double>*)f->Get("limit");
+	TParameter<double> *livetime = (TParameter<double>*)f->Get("livetime");
+	TNamed *corr_gen = (TNamed*)f->Get("corrections");
+	TNamed *iso_gen = (TNamed*)f->Get("isotope");
+	if (Q_gen) gen.Q_0 = Q_gen->GetVal();
+	if (res_gen) gen.res = res_gen->GetVal();
+	if (limit) gen.limit = limit->GetVal();
+	if (livetime) gen.livetime = livetime->GetVal();
+	if (corr_gen) gen.corrections = corr_gen->GetTitle();
+	if (iso_gen) gen.isotope = iso_gen->GetTitle();
+	return gen;
+}
+
+struct SpectrumModel {
+	CorrectionTable corr;	// Product of the corrections (empty = none)
+	ShapeSpectrum shape;	// Isotope spectrum (empty = N())
+
+	// Tables for data over [xlo, xhi] at the endpoint Q_0, widened by the folding range and by 10 eV for a free endpoint.
+	// Returns false, with a message, if the isotope or the corrections are not known
+	bool Init(const std::string &corrections, const std::string &isotope, double xlo, double xhi, double Q_0, double res, std::string &error, int n=4096) {
+		double lo = std::max(xlo - foldsigma*res - 10, 1e-3), hi = std::max(xhi, Q_0) + foldsigma*res + 10;
+		shape = ShapeSpectrum();
+		if (isotope != "") {
+			if (!find_isotope(isotope)) {
+				error = "unknown isotope " + isotope;
+				return false;
+			}
+			shape.Init(*find_isotope(isotope), lo, hi, n);
+		}
+		CorrectionStack stack;
+		corr = CorrectionTable();
+		if (!stack.Add(corrections, Q_0, error, shape.Empty() ? Z_2 : shape.Iso().Z, shape.Empty() ? 3 : shape.Iso().A)) return false;
+		if (stack.Size() > 0) corr.Init(stack, lo, hi, n);
+		return true;
+	}
+
+	// Model of the generation gen
+	bool Init(const GenInfo &gen, double xlo, double xhi, std::string &error, int n=4096) {
+		return Init(gen.corrections, gen.isotope, xlo, xhi, gen.Q_0, gen.res, error, n);
+	}
+
+	// Same model in a fitter. The fitter keeps pointers to the tables of this SpectrumModel
+	void Apply(BetaFitter &f) const {
+		f.SetCorrections(corr.Empty() ? 0 : &corr);
+		f.SetShape(shape.Empty() ? 0 : &shape);
+	}
+
+	// With T = double or Dual<n>, as N_gen(). The corrections do not carry derivatives
+	template<typename T>
+	T Eval(T T_e, T m_nu2, T C, T Q_0) const {
+		T n = shape.Empty() ? N_gen<T>(T_e, m_nu2, C, Q_0) : shape.Eval<T>(T_e, m_nu2, C, Q_0);
+		return corr.Empty() ? n : n*corr.Eval(value(T_e));
+	}
+
+	// Folded with the resolution res (0 = not folded)
+	template<typename T>
+	T Fold(T E, T m_nu2, T C, T Q_0, T res) const {
+		if (value(res) <= 0) return Eval<T>(E, m_nu2, C, Q_0);
+		return fold_gen<T>(E, res, [&](const T &T_e) { return Eval<T>(T_e, m_nu2, C, Q_0); });
+	}
+};
+
+// Starting value of C: sum of the data y over the sum of the model with C = 1 at the bin centers x (0 if either is not positive)
+inline double StartC(const SpectrumModel &model, const std::vector<double> &x, const std::vector<double> &y, double m_nu2, double Q_0, double res)
+{
+	double sy = 0, sN = 0;
+	for (size_t i=0; i<x.size(); i++) {
+		sy += y[i];
+		sN += model.Fold(x[i], m_nu2, 1., Q_0, res);
+	}
+	return sy > 0 && sN > 0 ? sy/sN : 0.;
+}
+
+#endif
@@ -0,0 +1,439 @@
+//********************************************************************
+// Fit service for parameter sweeps
+//
+// Listens on a Unix domain socket and fits m_nu^2 (and optionally Q and a
+// flat background) in beta spectra with BetaFitter, on a pool of worker
+// threads. ROOT, the macro and the folding nodes are loaded once, and the
+// histograms read from ROOT files are kept in memory (reread when the file
+// changes), so a fit costs milliseconds instead of a ROOT start-up. The
+// maxcached histograms and maxmodels model tables used last are kept.
+//
+// Protocol: one request per line, words key=value, one reply line each.
+//   file=<path> hist=<name>	histogram of a bdecay_sim file (hist defaults to histname)
+//   lo=<eV> hi=<eV> y=<n1,n2,...> [err=<e1,e2,...>]	or inline bins of equal width
+//   res= Q= fitmin= fitmax=	resolution, endpoint, fit range in eV (defaults: from the file, or 0, Q and
+//				the fitmin/fitmax below shifted with the endpoint). The lower edge is raised
+//				to limit + foldsigma*res (GenInfo::FitMin), limit being that of the file or lo=
+//   m2= freeQ=0/1 freeB=0/1	start of m_nu^2, free endpoint, free background
+//   corrections=<list>	spectral corrections of the model (default: those of the
+//				file, none for inline bins), see bdecay_corrections.h
+//   isotope=<name>		spectrum of an isotope instead of N() (default: the one of
+//				the file, N() for inline bins), see bdecay_shape.h
+//   id=<anything>		echoed in the reply
+// Reply: id= status= m2= m2_err= C= C_err= Q= Q_err= B= B_err= chi2= ndf= niter= fitmin= fitmax= ms=
+// status is 0 if the fit converged, 1 if not, 2 if the errors could not be
+// computed, -1 for a bad request, with error=<message> ending the line.
+// Histograms in rates (activity > 0 in bdecay_sim) are fitted in counts.
+// Other requests: "ping", "stats", "shutdown".
+//
+// A connection is served by one worker until the client closes it, so
+// clients should send their requests and close, e.g.
+//	echo "id=1 file=b.root freeQ=1" | socat - UNIX-CONNECT:$XDG_RUNTIME_DIR/bdecay_fitd.sock
+//
+// The service opens any file= path it is given and stops on "shutdown",
+// so only its owner may connect: the socket is created with mode 0600, by
+// default in $XDG_RUNTIME_DIR (private to the user), or else as
+// /tmp/bdecay_fitd.<uid>.sock.
+//
+// To run, do <root -l -b 'bdecay_fitd.cpp+'> (stops on "shutdown")
+//********************************************************************
+
+// C++ libs
+#include <iostream>
+#include<stdlib.h>	//rand, srand
+#include<cmath>
+#include<cstring>
+#include<cerrno>
+#include<string>
+#include<sstream>
+#include<vector>
+#include<map>
+#include<memory>
+#include<deque>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<atomic>
+#include<chrono>
+#include<signal.h>
+#include<poll.h>
+#include<unistd.h>
+#include<sys/socket.h>
+#include<sys/stat.h>
+#include<sys/un.h>
+
+// ROOT libs
+#include<TH1D.h>
+#include<TFile.h>
+#include<TParameter.h>
+
+using namespace std;
+
+////////////////// Parameters ///////////////////////
+// Initial nucleus
+const int Z_1 = 1;	// Atomic number of initial nucleus (3H)
+const double m_1 = 3.0160492;	// Isotope mass (in atomic mass units)
+
+// Final nucleus
+const int Z_2 = 2;	// Atomic number of final nucleus (3He)
+const double m_2 = 3.0160293;	// Isotope mass (in atomic mass units)
+
+// Other parameters
+const int charge = -1;
+const double Q = 18590; // Katrin Q Value (in eV)
+const string socket_path = "";	// Unix socket of the service ("" = $XDG_RUNTIME_DIR/bdecay_fitd.sock, or /tmp/bdecay_fitd.<uid>.sock)
+const int nworkers = 0;	// Number of fit threads (0 = number of cores)
+const int backlog = 256;	// Connections waiting for a worker before new ones are refused
+const string histname = "E_e_sm";	// Default histogram of file= requests
+const double fitmin = Q-25;	// Default fit range (relative to the generator Q, as in bdecay_plot.cpp), lower edge raised to GenInfo::FitMin
+const double fitmax = Q-0.2;
+const int maxiter = 100;	// Iterations of each fit
+const int maxcached = 64;	// Histograms kept in memory, the least recently used dropped first
+const int maxmodels = 32;	// Model tables kept in memory, likewise
+////////////////// End Of Parameters ///////////////
+
+// Physical Constants
+const double Pi = 3.14159265;	// Pi
+const double alpha = 1./137;	// Structure constant
+const double m_e = 0.510998910e6;	// Mass (in eV) of electron. From Wikipedia.
+
+// Spectrum kernels, generic over the scalar type (needs the constants above)
+#include "bdecay_spectrum.h"
+#include "bdecay_fit.h"
+
+// Histogram of a file, as read once
+struct CachedHist {
+	time_t mtime;	// Modification time of the file when it was read
+	unsigned long used;	// Value of lru_clock when last used
+	GenInfo gen;	// Generation of the file (inline data: Q, no folding, no corrections, limit lo)
+	vector<double> x, y;	// Bin centers and counts
+};
+
+// Tables of a model, as built once
+struct CachedModel {
+	shared_ptr<const SpectrumModel> model;	// Kept alive by the fits using it after it is dropped
+	unsigned long used;	// Value of lru_clock when last used
+};
+
+// State of the service
+map<string, CachedHist> cache;	// By "path:hist"
+map<string, CachedModel> models;	// By isotope, corrections and window
+unsigned long lru_clock = 0;	// Counts the uses of the cache and of the models
+mutex cache_lock;	// Guards cache, models and lru_clock
+mutex root_lock;	// ROOT file I/O is done by one thread at a time
+deque<int> pending;	// Accepted connections waiting for a worker
+mutex pending_lock;
+condition_variable pending_cv;
+atomic<bool> shutdown_requested(false);
+atomic<long> nrequests(0), nfits(0);
+
+// Functions
+string service_path();
+void serve();
+string handle(const string&, BetaFitter&);
+string fit(map<string, string>&, BetaFitter&);
+bool load_hist(const string&, const string&, CachedHist&, string&);
+shared_ptr<const SpectrumModel> get_model(const string&, const string&, double, double, double, double, string&);
+bool parse_list(const string&, vector<double>&);
+
+// Drops the least recently used entries of m until it holds at most n. Call with cache_lock held
+template<class T> void trim(map<string, T> &m, size_t n)
+{
+	while (m.size() > n) {
+		typename map<string, T>::iterator lru = m.begin();
+		for (typename map<string, T>::iterator it = m.begin(); it != m.end(); ++it) if (it->second.used < lru->second.used) lru = it;
+		m.erase(lru);
+	}
+}
+
+// Main program
+void bdecay_fitd(){
+	int nw = nworkers>0 ? nworkers : max(1u, thread::hardware_concurrency());
+	signal(SIGPIPE, SIG_IGN);	// A client that went away must not kill the service
+	string path = service_path();
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (connect(server, (sockaddr*)&addr, sizeof(addr)) == 0) {	// Only remove the socket file if nobody answers on it
+		cout << "A service is already running on " << path << endl;
+		close(server);
+		return;
+	}
+	close(server);
+	unlink(path.c_str());
+	server = socket(AF_UNIX, SOCK_STREAM, 0);
+	// Owner only from the start, then made explicit. The umask is process-wide: it must be changed
+	// here, before the worker pool starts, so that no other thread of the service creates files under it
+	mode_t mask = umask(0077);
+	bool bound = bind(server, (sockaddr*)&addr, sizeof(addr)) == 0;
+	umask(mask);
+	if (!bound || chmod(path.c_str(), 0600) != 0 || listen(server, backlog) != 0) {
+		cout << "Could not listen on " << path << ": " << strerror(errno) << endl;
+		close(server);
+		return;
+	}
+
+	fold_nodes();	// Folding nodes, computed before the first request
+	shutdown_requested = false;
+	vector<thread> pool;
+	for (int w=0; w<nw; w++) pool.push_back(thread(serve));
+	cout << "Fit service on " << path << " with " << nw << " workers" << endl;
+
+	// Hand the connections to the workers
+	auto start = chrono::steady_clock::now();
+	while (!shutdown_requested) {
+		pollfd p = {server, POLLIN, 0};
+		if (poll(&p, 1, 200) <= 0) continue;	// Wake up regularly to see shutdown
+		int fd = accept(server, 0, 0);
+		if (fd < 0) continue;
+		lock_guard<mutex> lock(pending_lock);
+		pending.push_back(fd);
+		pending_cv.notify_one();
+	}
+	pending_cv.notify_all();
+	for (int w=0; w<nw; w++) pool[w].join();
+	for (size_t i=0; i<pending.size(); i++) close(pending[i]);
+	pending.clear();
+	close(server);
+	unlink(path.c_str());
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << "Fit service stopped after " << elapsed << " s: " << nrequests << " requests, " << nfits << " fits" << endl;
+}
+
+// Path of the socket: socket_path, or a place private to the user
+string service_path()
+{
+	if (socket_path != "") return socket_path;
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	if (dir && *dir) return string(dir) + "/bdecay_fitd.sock";
+	return "/tmp/bdecay_fitd." + to_string(getuid()) + ".sock";
+}
+
+// Worker: serves one connection at a time, with its own fitter
+void serve()
+{
+	BetaFitter fitter;
+	while (true) {
+		int fd;
+		{
+			unique_lock<mutex> lock(pending_lock);
+			pending_cv.wait(lock, []() { return !pending.empty() || shutdown_requested; });
+			if (pending.empty()) return;	// Shutdown
+			fd = pending.front();
+			pending.pop_front();
+		}
+		string in;
+		char buf[65536];
+		while (!shutdown_requested) {
+			pollfd p = {fd, POLLIN, 0};
+			if (poll(&p, 1, 200) == 0) continue;
+			ssize_t n = read(fd, buf, sizeof(buf));
+			if (n <= 0) break;	// Closed by the client
+			in.append(buf, n);
+			size_t eol;
+			while ((eol = in.find('\n')) != string::npos) {
+				string reply = handle(in.substr(0, eol), fitter) + "\n";
+				in.erase(0, eol+1);
+				for (size_t done=0; done<reply.size(); ) {
+					ssize_t m = write(fd, reply.data()+done, reply.size()-done);
+					if (m <= 0) break;
+					done += m;
+				}
+			}
+		}
+		close(fd);
+	}
+}
+
+// Reply to one request line
+string handle(const string &line, BetaFitter &fitter)
+{
+	nrequests++;
+	istringstream words(line);
+	map<string, string> req;
+	string word;
+	while (words >> word) {
+		size_t eq = word.find('=');
+		req[word.substr(0, eq)] = eq == string::npos ? "" : word.substr(eq+1);
+	}
+	if (req.size() == 1 && req.count("ping")) return "status=0 pong";
+	if (req.size() == 1 && req.count("stats")) {
+		lock_guard<mutex> lock(cache_lock);
+		ostringstream out;
+		out << "status=0 requests=" << nrequests << " fits=" << nfits << " cached=" << cache.size() << " models=" << models.size();
+		return out.str();
+	}
+	if (req.size() == 1 && req.count("shutdown")) {
+		shutdown_requested = true;
+		return "status=0 stopping";
+	}
+	string id = req.count("id") ? "id=" + req["id"] + " " : "";
+	auto start = chrono::steady_clock::now();
+	string reply = fit(req, fitter);
+	if (reply.compare(0, 6, "error=") == 0) return id + "status=-1 " + reply;
+	ostringstream out;
+	out << id << reply << " ms=" << 1e3*chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return out.str();
+}
+
+// Fit of one request. Returns the result words, or "error=..."
+string fit(map<string, string> &req, BetaFitter &fitter)
+{
+	static const char *keys[] = {"id", "file", "hist", "lo", "hi", "y", "err", "res", "Q", "fitmin", "fitmax", "m2", "freeQ", "freeB", "corrections", "isotope"};
+	for (map<string, string>::iterator it = req.begin(); it != req.end(); ++it) {
+		bool known = false;
+		for (size_t k=0; k<sizeof(keys)/sizeof(keys[0]); k++) known = known || it->first == keys[k];
+		if (!known) return "error=unknown key " + it->first;
+	}
+
+	// Data: a cached histogram, or the inline bins
+	CachedHist data;
+	vector<double> err;
+	string error;
+	map<string, double> num;	// Numeric values
+	for (map<string, string>::iterator it = req.begin(); it != req.end(); ++it) {
+		if (it->first == "id" || it->first == "file" || it->first == "hist" || it->first == "y" || it->first == "err" || it->first == "corrections" || it->first == "isotope") continue;
+		char *end;
+		num[it->first] = strtod(it->second.c_str(), &end);
+		if (it->second.empty() || *end) return "error=bad number " + it->first + "=" + it->second;
+	}
+	if (req.count("file")) {
+		if (!load_hist(req["file"], req.count("hist") ? req["hist"] : histname, data, error)) return "error=" + error;
+	}
+	else if (req.count("y") && num.count("lo") && num.count("hi")) {
+		if (!parse_list(req["y"], data.y)) return "error=bad list y";
+		double width = (num["hi"] - num["lo"])/data.y.size();
+		for (size_t i=0; i<data.y.size(); i++) data.x.push_back(num["lo"] + (i+0.5)*width);
+		data.gen = GenInfo(Q, num["lo"]);
+		if (req.count("err") && (!parse_list(req["err"], err) || err.size() != data.y.size())) return "error=bad list err";
+	}
+	else return "error=no data (file= or lo= hi= y=)";
+	if (err.empty()) for (size_t i=0; i<data.y.size(); i++) err.push_back(sqrt(data.y[i]));
+	double Q_0 = num.count("Q") ? num["Q"] : data.gen.Q_0;
+	double res = num.count("res") ? num["res"] : data.gen.res;
+	double lo = data.gen.FitMin(num.count("fitmin") ? num["fitmin"] : fitmin-Q+Q_0, res), hi = num.count("fitmax") ? num["fitmax"] : fitmax-Q+Q_0;
+	string corrections = req.count("corrections") ? req["corrections"] : data.gen.corrections, isotope = req.count("isotope") ? req["isotope"] : data.gen.isotope;
+	shared_ptr<const SpectrumModel> model = get_model(corrections, isotope, lo, hi, Q_0, res, error);
+	if (!model) return "error=" + error;
+
+	// Bins in the fit range
+	vector<double> x, y, e;
+	for (size_t i=0; i<data.x.size(); i++) {
+		if (data.x[i] < lo || data.x[i] > hi) continue;
+		x.push_back(data.x[i]);
+		y.push_back(data.y[i]);
+		e.push_back(err[i]);
+	}
+	if (x.empty()) return "error=no bins in the fit range";
+
+	fitter.SetData(x.size(), &x[0], &y[0], &e[0]);
+	fitter.SetFolding(res);
+	model->Apply(fitter);
+	double C_0 = StartC(*model, x, y, 0., Q_0, res);
+	fitter.SetParameter(BetaFitter::M2, num.count("m2") ? num["m2"] : 0.);
+	fitter.SetParameter(BetaFitter::C, C_0 > 0 ? C_0 : 1.);
+	fitter.SetParameter(BetaFitter::Q_E, Q_0, !(num.count("freeQ") && num["freeQ"]));
+	fitter.SetParameter(BetaFitter::B, 0., !(num.count("freeB") && num["freeB"]));
+	int status = fitter.Fit(maxiter);
+	nfits++;
+
+	ostringstream out;
+	out.precision(10);
+	out << "status=" << status;
+	const char *names[] = {"m2", "C", "Q", "B"};
+	for (int k=0; k<BetaFitter::NPAR; k++) out << " " << names[k] << "=" << fitter.par[k] << " " << names[k] << "_err=" << fitter.err[k];
+	out << " chi2=" << fitter.chi2 << " ndf=" << fitter.ndf << " niter=" << fitter.niter << " fitmin=" << lo << " fitmax=" << hi;
+	return out.str();
+}
+
+// Histogram hist of the ROOT file path, from the cache unless the file changed since it was read
+bool load_hist(const string &path, const string &hist, CachedHist &data, string &error)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		error = "no file " + path;
+		return false;
+	}
+	string key = path + ":" + hist;
+	{
+		lock_guard<mutex> lock(cache_lock);
+		map<string, CachedHist>::iterator it = cache.find(key);
+		if (it != cache.end() && it->second.mtime == st.st_mtime) {
+			it->second.used = ++lru_clock;
+			data = it->second;
+			return true;
+		}
+	}
+
+	lock_guard<mutex> lock(root_lock);
+	TFile *rootfile = TFile::Open(path.c_str(), "read");
+	if (!rootfile || rootfile->IsZombie()) {
+		delete rootfile;
+		error = "cannot open " + path;
+		return false;
+	}
+	TH1D *h = (TH1D*)rootfile->Get(hist.c_str());
+	if (!h) {
+		rootfile->Close();
+		delete rootfile;
+		error = "no histogram " + hist + " in " + path;
+		return false;
+	}
+	data.mtime = st.st_mtime;
+	data.gen = ReadGenInfo(rootfile, Q, h->GetXaxis()->GetXmin());
+	data.x.clear();
+	data.y.clear();
+	for (int i=1; i<=h->GetNbinsX(); i++) {
+		data.x.push_back(h->GetBinCenter(i));
+		data.y.push_back(data.gen.Counts(h->GetBinContent(i)));
+	}
+	rootfile->Close();
+	delete rootfile;
+
+	lock_guard<mutex> cl(cache_lock);
+	data.used = ++lru_clock;
+	cache[key] = data;	// Replaces the entry of an older version of the file
+	trim(cache, maxcached);
+	return true;
+}
+
+// Model with the isotope and the corrections for a fit over [lo, hi], tables built once per model and window. 0, with a message, if not known
+shared_ptr<const SpectrumModel> get_model(const string &corrections, const string &isotope, double lo, double hi, double Q_0, double res, string &error)
+{
+	ostringstream key;
+	key.precision(10);
+	key << isotope << ":" << corrections << ":" << lo << ":" << hi << ":" << Q_0 << ":" << res;
+	{
+		lock_guard<mutex> lock(cache_lock);
+		map<string, CachedModel>::iterator it = models.find(key.str());
+		if (it != models.end()) {
+			it->second.used = ++lru_clock;
+			return it->second.model;
+		}
+	}
+	shared_ptr<SpectrumModel> model(new SpectrumModel());
+	if (!model->Init(corrections, isotope, lo, hi, Q_0, res, error)) return shared_ptr<const SpectrumModel>();
+	lock_guard<mutex> lock(cache_lock);
+	CachedModel &cached = models[key.str()];
+	cached.model = model;
+	cached.used = ++lru_clock;
+	trim(models, maxmodels);
+	return model;
+}
+
+// Comma-separated numbers
+bool parse_list(const string &s, vector<double> &v)
+{
+	v.clear();
+	const char *p = s.c_str();
+	while (*p) {
+		char *end;
+		v.push_back(strtod(p, &end));
+		if (end == p || (*end && *end != ',')) return false;
+		p = *end ? end+1 : end;
+	}
+	return !v.empty();
+}
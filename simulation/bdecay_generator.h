@@ -0,0 +1,276 @@
+//********************************************************************
+// Event generator assembled from policies
+//
+// Generator<Rng, Sampler, Smear, Accum, Real> is the generation loop of
+// bdecay_sim written once over:
+//   Rng	random engine: Rndm() in (0,1) and Gaus()
+//	(RngTRandom3, RngCounter, RngMT)
+//   Sampler	true kinetic energy: Sample(rng, T) returns false if rejected
+//	(SampleExact, SampleCheb: Von Neumann with N() or its Chebyshev
+//	surrogate; SampleCdf: inverse CDF tables; SampleShape: Von Neumann
+//	with the spectrum of another isotope)
+//   Smear	detector response: Smear(T, rng, z) (SmearGauss, SmearNone)
+//   Accum	where a batch of events goes: Fill(T_e, T_e_sm, z, n) and
+//	Progress(counter), provided by the macro
+//   Real	precision of the sampled energies (double or float; float
+//	energies are spaced by about 2 meV near 18.6 keV)
+// Every combination is a separate instantiation, so the policies are
+// inlined in the loop: there is no virtual call per event, only one per
+// run (GeneratorBase::Run). GeneratorRegistry maps names
+// "rng:sampler:smear:real", e.g. "counter:cdf:gauss:float", to the
+// instantiations made by default_registry().
+//
+// Include this file after bdecay_spectrum.h, bdecay_sampler.h and
+// bdecay_shape.h.
+//********************************************************************
+
+#ifndef BDECAY_GENERATOR_H
+#define BDECAY_GENERATOR_H
+
+#include<cmath>
+#include<map>
+#include<string>
+#include<vector>
+#include<atomic>
+#include<random>
+
+#include<TRandom3.h>
+
+#include "bdecay_rng.h"
+
+// Everything a generator needs, set up once by the macro
+struct GenConfig {
+	double lo, Q_0;	// Sampling window
+	double m_nu2;	// Neutrino mass squared
+	double res;	// Resolution
+	double N_max;	// Von Neumann bound
+	const ChebN *cheb;	// Chebyshev surrogate (SampleCheb)
+	const CdfFamily *cdf;	// Inverse CDF tables (SampleCdf), with the corrections built in
+	const CorrectionTable *corr;	// Spectral corrections of SampleExact, SampleCheb and SampleShape (0 = none). N_max must bound the corrected N()
+	const ShapeSpectrum *shape;	// Isotope spectrum (SampleShape)
+	unsigned long seed;
+	const std::atomic<bool> *stop;	// Checked between batches
+};
+
+////////////////// Random engines ///////////////////////
+// Gaus() by Box-Muller from the Rndm() of the engine, for engines without their own
+template<class Engine>
+struct BoxMuller {
+	bool has;	// A second normal number is cached
+	double next;
+
+	BoxMuller() : has(false), next(0) {}
+	double Gaus() {
+		if (has) {
+			has = false;
+			return next;
+		}
+		Engine &e = static_cast<Engine&>(*this);
+		double r = sqrt(-2*log(e.Rndm())), phi = 2*acos(-1.)*e.Rndm();
+		next = r*sin(phi);
+		has = true;
+		return r*cos(phi);
+	}
+};
+
+struct RngTRandom3 {	// ROOT's Mersenne twister, as the original generator
+	static const char* name() { return "trandom3"; }
+	TRandom3 rand;
+	explicit RngTRandom3(unsigned long seed) { rand.SetSeed(seed); }
+	double Rndm() { return rand.Rndm(); }
+	double Gaus() { return rand.Gaus(0,1); }
+};
+
+struct RngCounter : BoxMuller<RngCounter> {	// Counter-based stream (bdecay_rng.h)
+	static const char* name() { return "counter"; }
+	CounterRng stream;
+	uint64_t ctr;
+	explicit RngCounter(unsigned long seed) : stream(seed, 0x62646563, 0), ctr(0) {}
+	double Rndm() { return stream.Uniform(ctr++); }
+};
+
+struct RngMT : BoxMuller<RngMT> {	// std::mt19937_64
+	static const char* name() { return "mt"; }
+	std::mt19937_64 engine;
+	explicit RngMT(unsigned long seed) : engine(seed) {}
+	double Rndm() { return ((engine() >> 11) + 0.5)*(1./9007199254740992.); }
+};
+
+////////////////// Samplers ///////////////////////
+// Von Neumann acceptance-rejection with N() itself, see phys620 course notes (Monte Carlo p. 21)
+struct SampleExact {
+	static const char* name() { return "exact"; }
+	const GenConfig &c;
+	explicit SampleExact(const GenConfig &c_) : c(c_) {}
+	template<class Rng> bool Sample(Rng &rng, double &T_e) const {
+		T_e = c.lo + (c.Q_0 - c.lo)*rng.Rndm();	// Number between lo and Q, as there is no energy above Q
+		double u = rng.Rndm();
+		double n = N_gen<double>(T_e, c.m_nu2, 1., c.Q_0);
+		if (c.corr) n *= c.corr->Eval(T_e);	// One interpolation for all the corrections
+		return u <= n/c.N_max;
+	}
+};
+
+// Same with the Chebyshev surrogate of N()
+struct SampleCheb {
+	static const char* name() { return "cheb"; }
+	const GenConfig &c;
+	explicit SampleCheb(const GenConfig &c_) : c(c_) {}
+	template<class Rng> bool Sample(Rng &rng, double &T_e) const {
+		T_e = c.lo + (c.Q_0 - c.lo)*rng.Rndm();
+		double u = rng.Rndm();
+		double n = c.cheb->Eval(T_e, c.m_nu2, 1., c.Q_0);
+		if (c.corr) n *= c.corr->Eval(T_e);
+		return u <= n/c.N_max;
+	}
+};
+
+// Same with the spectrum of another isotope, e.g. with a forbidden shape factor (bdecay_shape.h)
+struct SampleShape {
+	static const char* name() { return "shape"; }
+	const GenConfig &c;
+	explicit SampleShape(const GenConfig &c_) : c(c_) {}
+	template<class Rng> bool Sample(Rng &rng, double &T_e) const {
+		T_e = c.lo + (c.Q_0 - c.lo)*rng.Rndm();
+		double u = rng.Rndm();
+		double n = c.shape->Eval<double>(T_e, c.m_nu2, 1., c.Q_0);
+		if (c.corr) n *= c.corr->Eval(T_e);
+		return u <= n/c.N_max;
+	}
+};
+
+// Inverse CDF tables: every event is accepted
+struct SampleCdf {
+	static const char* name() { return "cdf"; }
+	const GenConfig &c;
+	explicit SampleCdf(const GenConfig &c_) : c(c_) {}
+	template<class Rng> bool Sample(Rng &rng, double &T_e) const {
+		T_e = c.cdf->Sample(rng.Rndm(), c.m_nu2);
+		return true;
+	}
+};
+
+////////////////// Smearing ///////////////////////
+struct SmearGauss {	// Gaussian resolution. z is the standard normal number used
+	static const char* name() { return "gauss"; }
+	double res;
+	explicit SmearGauss(const GenConfig &c) : res(c.res) {}
+	template<class Rng, class Real> Real Smear(Real T_e, Rng &rng, Real &z) const {
+		z = rng.Gaus();
+		return T_e + Real(res)*z;
+	}
+};
+
+struct SmearNone {	// Perfect detector
+	static const char* name() { return "none"; }
+	explicit SmearNone(const GenConfig&) {}
+	template<class Rng, class Real> Real Smear(Real T_e, Rng&, Real &z) const {
+		z = 0;
+		return T_e;
+	}
+};
+
+template<class Real> struct RealName;
+template<> struct RealName<double> { static const char* name() { return "double"; } };
+template<> struct RealName<float> { static const char* name() { return "float"; } };
+
+////////////////// Generator ///////////////////////
+class GeneratorBase {
+public:
+	virtual ~GeneratorBase() {}
+	virtual long Run(long nev) = 0;	// Generate nev events (fewer if stopped). Returns the number generated
+};
+
+template<class Rng, class Sampler, class Smear, class Accum, class Real>
+class Generator : public GeneratorBase {
+public:
+	static const int nbatch = 4096;	// Events sampled between two fills of the accumulator
+
+	Generator(const GenConfig &c_, Accum &acc_) : c(c_), rng(c_.seed), sampler(c), smear(c), acc(acc_) {}
+
+	long Run(long nev) {
+		Real T_e[nbatch];	// True kinetic energies of the electrons
+		Real T_e_sm[nbatch];	// Smeared kinetic energies
+		Real z[nbatch];	// Standard normal numbers of the smearing
+		long counter = 0;
+		while (counter < nev && !*c.stop) {
+			int n = std::min(long(nbatch), nev-counter);
+			for (int i=0; i<n; ) {
+				double T;
+				if (!sampler.Sample(rng, T)) continue;	// Rejected
+				T_e[i] = Real(T);
+				T_e_sm[i] = smear.Smear(T_e[i], rng, z[i]);
+				i++;
+			}
+			acc.Fill(T_e, T_e_sm, z, n);
+			counter += n;
+			acc.Progress(counter);
+		}
+		return counter;
+	}
+
+private:
+	GenConfig c;
+	Rng rng;
+	Sampler sampler;
+	Smear smear;
+	Accum &acc;
+};
+
+////////////////// Registry ///////////////////////
+template<class Accum>
+class GeneratorRegistry {
+public:
+	typedef GeneratorBase* (*Factory)(const GenConfig&, Accum&);
+
+	template<class Rng, class Sampler, class Smear, class Real>
+	void Add() {
+		std::string name = std::string(Rng::name()) + ":" + Sampler::name() + ":" + Smear::name() + ":" + RealName<Real>::name();
+		factories[name] = &Make<Rng, Sampler, Smear, Real>;
+	}
+
+	// New generator for the name "rng:sampler:smear:real", 0 if there is no such combination
+	GeneratorBase* Create(const std::string &name, const GenConfig &c, Accum &acc) const {
+		typename std::map<std::string, Factory>::const_iterator it = factories.find(name);
+		return it == factories.end() ? 0 : it->second(c, acc);
+	}
+
+	bool Has(const std::string &name) const { return factories.count(name) > 0; }
+
+	std::vector<std::string> Names() const {
+		std::vector<std::string> names;
+		for (typename std::map<std::string, Factory>::const_iterator it = factories.begin(); it != factories.end(); ++it) names.push_back(it->first);
+		return names;
+	}
+
+private:
+	std::map<std::string, Factory> factories;
+
+	template<class Rng, class Sampler, class Smear, class Real>
+	static GeneratorBase* Make(const GenConfig &c, Accum &acc) { return new Generator<Rng, Sampler, Smear, Accum, Real>(c, acc); }
+};
+
+// All combinations of the policies above
+template<class... T> struct TypeList {};
+
+template<class Accum, class Rng, class Sampler, class Smear, class... Real>
+void register_reals(GeneratorRegistry<Accum> &r, TypeList<Real...>) { (r.template Add<Rng, Sampler, Smear, Real>(), ...); }
+
+template<class Accum, class Rng, class Sampler, class... Smear>
+void register_smears(GeneratorRegistry<Accum> &r, TypeList<Smear...>) { (register_reals<Accum, Rng, Sampler, Smear>(r, TypeList<double, float>()), ...); }
+
+template<class Accum, class Rng, class... Sampler>
+void register_samplers(GeneratorRegistry<Accum> &r, TypeList<Sampler...>) { (register_smears<Accum, Rng, Sampler>(r, TypeList<SmearGauss, SmearNone>()), ...); }
+
+template<class Accum, class... Rng>
+void register_rngs(GeneratorRegistry<Accum> &r, TypeList<Rng...>) { (register_samplers<Accum, Rng>(r, TypeList<SampleExact, SampleCheb, SampleCdf, SampleShape>()), ...); }
+
+template<class Accum>
+GeneratorRegistry<Accum> default_registry()
+{
+	GeneratorRegistry<Accum> r;
+	register_rngs<Accum>(r, TypeList<RngTRandom3, RngCounter, RngMT>());
+	return r;
+}
+
+#endif
@@ -0,0 +1,176 @@
+//********************************************************************
+// Histograms for the generator threads
+//
+// SparseHist: very fine fixed-width binning (down to 1 meV) over the whole
+// spectrum. Bins are grouped in pages of 4096 that are only allocated the
+// first time one of their bins is filled, so memory follows the populated
+// range. Each generator thread fills its own SparseHist; they are merged at
+// the end and a region of interest is converted to a dense TH1D for fitting.
+//
+// MultiResHist: nested levels of binning sharing the same upper edge, e.g.
+// coarse bins over [0, Q] and finer and finer bins over the last few eV.
+// One Fill() updates every level containing x with one multiplication per
+// level (by the inverse bin width).
+// Each level is written as a TH1D <name>_L<level> and read back with Read().
+//********************************************************************
+
+#ifndef BDECAY_HISTO_H
+#define BDECAY_HISTO_H
+
+#include<cmath>
+#include<string>
+#include<vector>
+
+#include<TH1D.h>
+#include<TFile.h>
+
+class SparseHist {
+public:
+	static const int pagebits = 12;	// 4096 bins per page
+	static const long pagesize = 1L << pagebits;
+
+	SparseHist() : lo(0), width(1), nbins(0), under(0), over(0), entries(0) {}
+	SparseHist(double lo_, double hi_, double width_) : lo(lo_), width(width_), under(0), over(0), entries(0) {
+		nbins = long(ceil((hi_-lo_)/width_));
+		pages.resize((nbins + pagesize-1) >> pagebits);
+	}
+
+	void Fill(double x, double w=1.) {
+		entries++;
+		double b = (x - lo)/width;
+		if (b < 0) { under += w; return; }
+		long i = long(b);
+		if (i >= nbins) { over += w; return; }
+		std::vector<double> &p = pages[i >> pagebits];
+		if (p.empty()) p.assign(pagesize, 0.);	// First touch of this page
+		p[i & (pagesize-1)] += w;
+	}
+
+	// Content of bin i (0 to nbins-1)
+	double GetBinContent(long i) const {
+		const std::vector<double> &p = pages[i >> pagebits];
+		return p.empty() ? 0. : p[i & (pagesize-1)];
+	}
+
+	// Add the content of another histogram with the same binning
+	void Merge(const SparseHist &o) {
+		for (size_t k=0; k<pages.size(); k++) {
+			if (o.pages[k].empty()) continue;
+			if (pages[k].empty()) {
+				pages[k] = o.pages[k];
+				continue;
+			}
+			for (long i=0; i<pagesize; i++) pages[k][i] += o.pages[k][i];
+		}
+		under += o.under;
+		over += o.over;
+		entries += o.entries;
+	}
+
+	// Dense histogram of the bins in [x1, x2], for fitting
+	TH1D* Dense(const char *name, double x1, double x2) const {
+		long i1 = std::max(0L, long(floor((x1-lo)/width))), i2 = std::min(nbins, long(ceil((x2-lo)/width)));
+		if (i2 <= i1) i2 = i1+1;
+		TH1D *h = new TH1D(name, ";E_{e} [eV];Intensity", i2-i1, lo + i1*width, lo + i2*width);
+		double sum = 0;
+		for (long i=i1; i<i2; i++) {
+			double c = GetBinContent(i);
+			h->SetBinContent(i-i1+1, c);
+			sum += c;
+		}
+		h->SetEntries(sum);
+		return h;
+	}
+
+	long Pages() const {	// Number of allocated pages
+		long n = 0;
+		for (size_t k=0; k<pages.size(); k++) n += !pages[k].empty();
+		return n;
+	}
+
+	double lo, width;	// Lower edge and bin width
+	long nbins;	// Total number of bins
+	double under, over;	// Underflow and overflow
+	double entries;
+
+private:
+	std::vector< std::vector<double> > pages;	// Empty until first touch
+};
+
+class MultiResHist {
+public:
+	MultiResHist() : hi(0) {}
+	explicit MultiResHist(double hi_) : hi(hi_) {}
+
+	// Add a level of nbins bins over [lo, hi]. Levels must be added from the coarsest (lowest lo) to the finest
+	void AddLevel(double lo, int nbins) {
+		Level l;
+		l.lo = lo;
+		l.nbins = nbins;
+		l.inv_width = nbins/(hi-lo);
+		l.c.assign(nbins, 0.);
+		levels.push_back(l);
+	}
+
+	void Fill(double x, double w=1.) {
+		if (x >= hi) return;
+		for (size_t k=0; k<levels.size(); k++) {
+			Level &l = levels[k];
+			if (x < l.lo) break;	// Levels are nested, so x is below all finer levels too
+			l.c[std::min(int((x-l.lo)*l.inv_width), l.nbins-1)] += w;
+		}
+	}
+
+	void Merge(const MultiResHist &o) {
+		for (size_t k=0; k<levels.size(); k++) {
+			for (int i=0; i<levels[k].nbins; i++) levels[k].c[i] += o.levels[k].c[i];
+		}
+	}
+
+	int NLevels() const { return levels.size(); }
+	double GetBinContent(int level, int i) const { return levels[level].c[i]; }	// Bin i (0 to nbins-1) of a level
+
+	// TH1D of one level, 0 if there is no such level
+	TH1D* Get(const std::string &name, int level) const {
+		if (level < 0 || level >= NLevels()) return 0;
+		const Level &l = levels[level];
+		TH1D *h = new TH1D((name + "_L" + std::to_string(level)).c_str(), ";E_{e} [eV];Intensity", l.nbins, l.lo, hi);
+		double sum = 0;
+		for (int i=0; i<l.nbins; i++) {
+			h->SetBinContent(i+1, l.c[i]);
+			sum += l.c[i];
+		}
+		h->SetEntries(sum);
+		return h;
+	}
+
+	void Write(const std::string &name) const {
+		for (int k=0; k<NLevels(); k++) Get(name, k)->Write();
+	}
+
+	// Read back the levels written by Write()
+	static MultiResHist Read(TFile *f, const std::string &name) {
+		MultiResHist m;
+		for (int k=0; ; k++) {
+			TH1D *h = (TH1D*)f->Get((name + "_L" + std::to_string(k)).c_str());
+			if (!h) break;
+			m.hi = h->GetXaxis()->GetXmax();
+			m.AddLevel(h->GetXaxis()->GetXmin(), h->GetNbinsX());
+			for (int i=0; i<h->GetNbinsX(); i++) m.levels[k].c[i] = h->GetBinContent(i+1);
+		}
+		return m;
+	}
+
+	double hi;	// Upper edge of all levels
+
+private:
+	struct Level {
+		double lo;	// Lower edge
+		double inv_width;	// 1/bin width
+		int nbins;
+		std::vector<double> c;	// Bin contents
+	};
+	std::vector<Level> levels;
+};
+
+#endif
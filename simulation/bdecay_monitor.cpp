@@ -0,0 +1,141 @@
+//********************************************************************
+// Live monitor of a running bdecay_sim
+//
+// Attaches to the shared-memory segment published by bdecay_sim (set
+// shm_name there), and every period seconds draws the latest snapshot of
+// E_e and E_e_sm and fits m_nu^2 in E_e_sm, with the model of the
+// generation, without disturbing the generator. Stops when the generation
+// is over.
+//
+// To run, do <root -l bdecay_monitor.cpp> while bdecay_sim is running
+//********************************************************************
+
+// C++ libs
+#include <iostream>
+#include<stdlib.h>	//rand, srand
+#include<cmath>
+#include<vector>
+#include<thread>
+#include<chrono>
+
+// ROOT libs
+#include<TH1D.h>
+#include<TCanvas.h>
+#include<TSystem.h>
+
+using namespace std;
+
+////////////////// Parameters ///////////////////////
+// Nuclei
+const int Z_1 = 1;	// Atomic number of initial nucleus (3H)
+const int Z_2 = 2;	// Atomic number of final nucleus (3He)
+
+// Other parameters
+const int charge = -1;
+const string shm_name = "/bdecay";	// Segment name, as shm_name in bdecay_sim.cpp
+const double period = 2;	// Seconds between two snapshots
+const double wait = 60;	// Seconds to wait for the generator to create the segment
+const double fit_lo_offset = 25;	// Fit range [Q-fit_lo_offset, Q-fit_hi_offset] below the generator Q, its lower edge
+const double fit_hi_offset = 0.2;	// raised to limit + foldsigma*res (GenInfo::FitMin)
+////////////////// End Of Parameters ///////////////
+
+// Physical Constants
+const double Pi = 3.14159265;	// Pi
+const double alpha = 1./137;	// Structure constant
+const double m_e = 0.510998910e6;	// Mass (in eV) of electron. From Wikipedia.
+
+// Spectrum kernels, generic over the scalar type (needs the constants above)
+#include "bdecay_spectrum.h"
+#include "bdecay_fit.h"
+#include "bdecay_shm.h"
+
+// Main program
+void bdecay_monitor(){
+	ShmSnapshot shm;
+	for (double t=0; !shm.Attach(shm_name); t+=0.5) {
+		if (t >= wait) {
+			cout << "No generator found at " << shm_name << endl;
+			return;
+		}
+		this_thread::sleep_for(chrono::milliseconds(500));
+	}
+	const ShmHeader *hd = shm.Header();
+	int n = hd->nbins;
+	cout << "Attached to " << shm_name << ": " << n << " bins in [" << hd->lo << ", " << hd->hi << "] eV, Q = " << hd->Q << " eV, res = " << hd->res << " eV" << endl;
+	GenInfo gen(hd->Q, hd->limit);
+	gen.res = hd->res;
+	double fitmin = gen.FitMin(hd->Q-fit_lo_offset, hd->res), fitmax = hd->Q-fit_hi_offset;
+	cout << "Fit range [" << fitmin << ", " << fitmax << "] eV" << endl;
+	gen.corrections = hd->corrections;
+	gen.isotope = hd->isotope;
+	SpectrumModel model;	// Model of the generation
+	string error;
+	if (!model.Init(gen, fitmin, fitmax, error)) {
+		cout << shm_name << ": " << error << endl;
+		return;
+	}
+	if (gen.corrections != "") cout << "Corrections: " << gen.corrections << endl;
+	if (gen.isotope != "") cout << "Isotope: " << gen.isotope << endl;
+
+	// ROOT Histograms, refreshed from the snapshots
+	TH1D *E_e = new TH1D("E_e_live", ";E_{e} [eV];Intensity", n, hd->lo, hd->hi);
+	TH1D *E_e_sm = new TH1D("E_e_sm_live", ";E_{e} [eV];Intensity", n, hd->lo, hd->hi);
+	TCanvas *c1=new TCanvas("monitor","monitor");	// ROOT canvas creation
+	E_e->SetFillColor(4);	// blue
+	E_e_sm->SetFillColor(3);	// green
+
+	// Fit of E_e_sm, warm-started from the previous snapshot
+	BetaFitter fitter;
+	fitter.SetFolding(hd->res);
+	model.Apply(fitter);
+	fitter.SetParameter(BetaFitter::Q_E, hd->Q, true);
+	bool started = false;
+
+	ShmFrame frame;
+	vector<double> e, esm, x, y, err;
+	long last = -1;
+	while (true) {
+		bool done = shm.Done();	// Read before the snapshot, so that the final snapshot is not missed
+		if (shm.Read(frame, e, esm) && frame.nevents != last) {
+			last = frame.nevents;
+			for (int i=0; i<n+2; i++) {
+				E_e->SetBinContent(i, e[i]);
+				E_e_sm->SetBinContent(i, esm[i]);
+			}
+			E_e->SetEntries(frame.nevents);
+			E_e_sm->SetEntries(frame.nevents);
+
+			x.clear();
+			y.clear();
+			err.clear();
+			for (int i=1; i<=n; i++) {
+				double xi = E_e_sm->GetBinCenter(i);
+				if (xi < fitmin || xi > fitmax) continue;
+				x.push_back(xi);
+				y.push_back(esm[i]);
+				err.push_back(sqrt(esm[i]));
+			}
+			if (x.empty()) continue;
+			fitter.SetData(x.size(), &x[0], &y[0], &err[0]);
+			if (!started) {
+				double C_0 = StartC(model, x, y, 0., hd->Q, hd->res);
+				fitter.SetParameter(BetaFitter::C, C_0);
+				started = C_0 > 0;
+			}
+			int status = started ? fitter.Fit() : 1;
+			cout << frame.elapsed << " s: " << frame.nevents << " events, Q_eff = " << frame.Q_eff << " eV, " << frame.tail << " events in the last eV";
+			if (status == 0) cout << ", m_nu^2 = " << fitter.par[BetaFitter::M2] << " +- " << fitter.err[BetaFitter::M2] << " eV^2";
+			cout << endl;
+
+			c1->cd();
+			E_e->Draw();
+			E_e_sm->Draw("same");
+			c1->Modified();
+			c1->Update();
+		}
+		if (done) break;
+		gSystem->ProcessEvents();
+		this_thread::sleep_for(chrono::milliseconds(int(1000*period)));
+	}
+	cout << "Generation over" << endl;
+}
@@ -0,0 +1,100 @@
+//********************************************************************
+// NUMA placement of the generator threads (Linux)
+//
+// NumaLayout reads the CPUs of each NUMA node from
+// /sys/devices/system/node/node<k>/cpulist, keeping only the CPUs the
+// process may run on. Without that directory (or on other systems) there
+// is a single node with all the CPUs. Place() spreads threads evenly over
+// the nodes, one CPU each, and pin_thread() binds the calling thread to
+// its CPU, so that the memory it touches first is allocated on its node.
+// No libnuma is needed.
+//********************************************************************
+
+#ifndef BDECAY_NUMA_H
+#define BDECAY_NUMA_H
+
+#include<fstream>
+#include<sstream>
+#include<string>
+#include<vector>
+#include<thread>
+#ifdef __linux__
+#include<pthread.h>
+#include<sched.h>
+#endif
+
+// CPUs of a list like "0-7,16-23"
+inline std::vector<int> parse_cpulist(const std::string &list)
+{
+	std::vector<int> cpus;
+	std::stringstream ss(list);
+	std::string range;
+	while (std::getline(ss, range, ',')) {
+		if (range.empty() || range[0] == '\n') continue;
+		size_t dash = range.find('-');
+		int a = std::stoi(range.substr(0, dash)), b = dash == std::string::npos ? a : std::stoi(range.substr(dash+1));
+		for (int c=a; c<=b; c++) cpus.push_back(c);
+	}
+	return cpus;
+}
+
+// Bind the calling thread to one CPU. Returns false if it could not be done
+inline bool pin_thread(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+struct NumaLayout {
+	std::vector< std::vector<int> > cpus;	// Usable CPUs of each node
+
+	static NumaLayout Detect() {
+		NumaLayout l;
+#ifdef __linux__
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		bool mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+		std::ifstream online("/sys/devices/system/node/online");	// Node numbers, e.g. "0-1" (can have holes)
+		std::string nodes;
+		if (online) std::getline(online, nodes);
+		std::vector<int> ids = parse_cpulist(nodes);
+		for (size_t k=0; k<ids.size(); k++) {
+			std::ifstream f(("/sys/devices/system/node/node" + std::to_string(ids[k]) + "/cpulist").c_str());
+			std::string list;
+			if (!f || !std::getline(f, list)) continue;
+			std::vector<int> node, all = parse_cpulist(list);
+			for (size_t i=0; i<all.size(); i++) if (!mask || CPU_ISSET(all[i], &allowed)) node.push_back(all[i]);
+			if (!node.empty()) l.cpus.push_back(node);
+		}
+#endif
+		if (l.cpus.empty()) {	// No NUMA information: one node
+			l.cpus.resize(1);
+			unsigned n = std::max(1u, std::thread::hardware_concurrency());
+			for (unsigned c=0; c<n; c++) l.cpus[0].push_back(c);
+		}
+		return l;
+	}
+
+	int Nodes() const { return cpus.size(); }
+
+	// Node and CPU of each of nth threads: thread t goes to node t % Nodes(), on the next free CPU of that node
+	// (CPUs are reused when there are more threads than CPUs)
+	void Place(int nth, std::vector<int> &node, std::vector<int> &cpu) const {
+		node.resize(nth);
+		cpu.resize(nth);
+		std::vector<int> next(Nodes(), 0);
+		for (int t=0; t<nth; t++) {
+			int k = t % Nodes();
+			node[t] = k;
+			cpu[t] = cpus[k][next[k]++ % cpus[k].size()];
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,87 @@
+//********************************************************************
+// Online estimators, updated by the generator threads and read while
+// the generation continues
+//
+// EndpointEstimator: bounded min-heap of the k highest smeared energies
+// plus fine counts in the tail. Near the endpoint the number of events
+// above E goes like (Q_eff - E)^3, so the j-th highest energy is
+// x_j = Q_eff - a j^(1/3), and a straight line fit of x_j against j^(1/3)
+// gives Q_eff as its intercept. Each thread fills its own estimator; the
+// monitoring loop merges copies of them on demand.
+//********************************************************************
+
+#ifndef BDECAY_ONLINE_H
+#define BDECAY_ONLINE_H
+
+#include<cmath>
+#include<vector>
+#include<algorithm>
+#include<functional>
+
+struct EndpointEstimator {
+	int k;	// Number of highest energies kept
+	std::vector<double> top;	// Min-heap of the k highest energies
+	double tail_lo, tail_width;	// Fine binning of the tail
+	std::vector<double> tail;	// Counts in the tail bins
+
+	EndpointEstimator() : k(0), tail_lo(0), tail_width(1) {}
+	EndpointEstimator(int k_, double lo, double hi, int ntail) : k(k_), tail_lo(lo), tail_width((hi-lo)/ntail), tail(ntail, 0.) {
+		top.reserve(k);
+	}
+
+	void Fill(double x) {
+		Fill_top(x);
+		double b = (x - tail_lo)/tail_width;
+		if (b >= 0 && b < tail.size()) tail[int(b)]++;	// Fine tail counts
+	}
+
+	void Merge(const EndpointEstimator &o) {
+		for (size_t i=0; i<o.top.size(); i++) Fill_top(o.top[i]);
+		for (size_t i=0; i<tail.size(); i++) tail[i] += o.tail[i];
+	}
+
+	// Observed endpoint, from the straight line fit of the ordered highest energies against j^(1/3)
+	double Qeff() const {
+		std::vector<double> x(top);
+		std::sort(x.begin(), x.end(), std::greater<double>());
+		int n = x.size();
+		if (n < 3) return n ? x[0] : 0.;
+		double s1 = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+		for (int j=0; j<n; j++) {
+			double t = cbrt(j+0.5);	// Mid-rank, the highest event has rank 1/2
+			s1++;
+			sx += t;
+			sy += x[j];
+			sxx += t*t;
+			sxy += t*x[j];
+		}
+		double slope = (s1*sxy - sx*sy)/(s1*sxx - sx*sx);
+		return (sy - slope*sx)/s1;
+	}
+
+	// Number of events in [a, b] from the tail bins (partial bins are prorated)
+	double Counts(double a, double b) const {
+		double sum = 0;
+		for (size_t i=0; i<tail.size(); i++) {
+			double lo = tail_lo + i*tail_width;
+			double overlap = std::min(b, lo+tail_width) - std::max(a, lo);
+			if (overlap > 0) sum += tail[i]*overlap/tail_width;
+		}
+		return sum;
+	}
+
+private:
+	void Fill_top(double x) {	// Heap update only (the tail counts are merged separately)
+		if ((int)top.size() < k) {
+			top.push_back(x);
+			std::push_heap(top.begin(), top.end(), std::greater<double>());
+		}
+		else if (x > top[0]) {	// Replace the lowest of the k highest
+			std::pop_heap(top.begin(), top.end(), std::greater<double>());
+			top.back() = x;
+			std::push_heap(top.begin(), top.end(), std::greater<double>());
+		}
+	}
+};
+
+#endif
@@ -16,6 +16,10 @@
 #include<TFile.h>
 #include<TMath.h>
 #include<TRandom3>
+#include<TH2D.h>
+#include<TMinuit.h>
+#include<TStopwatch.h>
+#include<TParameter.h>
 
 using namespace std;
 
@@ -33,8 +37,12 @@ const int charge = -1;
 //const double Q = 931.494095e6*(m_1-m_2);
 const double Q = 18590; // Katrin Q Value (in eV)
 const int ndivisions = 100;	// Number of divisions in energy histograms
-const double fitmax = Q-25;
-const double fitmin = Q-0.2;
+const double fitmin = Q-25;	// Lower edge of the fit range (see bdecay_scan.cpp to choose it)
+const double fitmax = Q-0.2;	// Upper edge of the fit range
+const int level = -1;	// Level of the multi-resolution histograms E_e_L<l>, E_e_sm_L<l> to fit (-1 = E_e, E_e_sm)
+const int nbench = 0;	// Number of repetitions of each fit to time BetaFitter against TH1::Fit (0 = no comparison)
+const string covfile = "";	// Rootfile written by bdecay_syst.cpp. If not empty, E_e_sm is also fitted with its full covariance matrix
+const bool freeQ = false;	// Also fit m_nu^2, C and the endpoint Q together (E_e_sm with the folded model), see fit_free_Q
 ////////////////// End Of Parameters ///////////////
 
 // Physical Constants
@@ -45,10 +53,28 @@ const double m_n = 939.5654133e6;	// Mass (in eV) of neutron. From Wikipedia.
 const double m_e = 0.510998910e6;	// Mass (in eV) of electron. From Wikipedia.
 const double m_nu= 0.2;	// Mass (in eV) of neutrino. Value was given in our project synopsis
 
+// Spectrum kernels, generic over the scalar type (needs the constants above)
+#include "bdecay_spectrum.h"
+#include "bdecay_fit.h"
+#include "bdecay_histo.h"
+
+SpectrumModel model;	// Spectrum of the generation (isotope and spectral corrections), as recorded in the file
+
+// Data of the covariance matrix fit, used by fcn_cov
+vector<double> cov_x;	// Bin centers in the fit range
+vector<double> cov_y;	// Bin contents in the fit range
+vector<double> cov_r;	// Residuals
+CovChi2 cov_chi2;	// Cholesky factor of the covariance matrix, computed once
+
 // Functions
 double N(double, double, double);		// Distribution of energy, N(T_e)
 double F(int, double, int);	// Fermi function, F(Z',T_e)
+double NQ(double, double, double, double, double);	// N(T_e) with m_nu^2 and Q as parameters, folded with res
 void gint(TF1*);
+bool setup_covfit(TH1D*, TH2D*);
+void fcn_cov(int&, double*, double&, double*, int);
+void compare_fitters(TH1D*, TF1*);
+void fit_free_Q(TH1D*, TF1*, const GenInfo&, double);
 
 // Main program
 void bdecay_plot(string filename){
@@ -60,6 +86,24 @@ void bdecay_plot(string filename){
 	// ROOT Histograms
 	TH1D *E_e = (TH1D*)rootfile->Get("E_e");
 	TH1D *E_e_sm = (TH1D*)rootfile->Get("E_e_sm");
+	if (level >= 0) {
+		MultiResHist mr = MultiResHist::Read(rootfile, "E_e"), mr_sm = MultiResHist::Read(rootfile, "E_e_sm");
+		if (level >= mr.NLevels() || level >= mr_sm.NLevels()) {
+			cout << "Level " << level << " not in " << filename << ".root, which has " << min(mr.NLevels(), mr_sm.NLevels()) << " levels" << endl;
+			return;
+		}
+		E_e = mr.Get("E_e", level);
+		E_e_sm = mr_sm.Get("E_e_sm", level);
+	}
+	GenInfo gen = ReadGenInfo(rootfile, Q, E_e_sm->GetXaxis()->GetXmin());
+	double Q_0 = gen.Q_0, res_0 = gen.res;
+	string error;
+	if (!model.Init(gen, E_e_sm->GetXaxis()->GetXmin(), E_e_sm->GetXaxis()->GetXmax(), error)) {
+		cout << filename << ".root: " << error << endl;
+		return;
+	}
+	if (gen.corrections != "") cout << "Corrections: " << gen.corrections << endl;
+	if (gen.isotope != "") cout << "Isotope: " << gen.isotope << (fabs(Q_0 - Q) > 0.01*Q ? ", set Q to its endpoint " + to_string(Q_0) + " eV for the fits with a fixed Q" : "") << endl;
 
 	// ROOT fit function
 	TF1 *func = new TF1("func", "N(x,[0],[1])",fitmin ,fitmax);
@@ -74,33 +118,191 @@ void bdecay_plot(string filename){
 
 
 	TCanvas *c1=new TCanvas("E_e","E_e");	// ROOT canvas creation
-	fit = E_e->Fit("func","RMS");
+	TFitResultPtr fit = E_e->Fit("func","RMS");
 	E_e->SetFillColor(4);	//blue
 	E_e->Draw();	// Draw histogram
 	cout << "ChiSq = " << fit->Chi2() << endl;
+	if (nbench > 0) compare_fitters(E_e, func);
+	if (freeQ) fit_free_Q(E_e, func, gen, 0.);
 
 		//double sumundercurve = func->Integral(Q-25,Q);
 		//cout << "sumundercurve = " << sumundercurve << endl;
 
 	TCanvas *c2=new TCanvas("E_e_sm","E_e_sm");	// ROOT canvas creation
 	func->SetParName(0,"m_nu_sm");
-	fit_sm = E_e_sm->Fit("func","RMS");
+	TFitResultPtr fit_sm = E_e_sm->Fit("func","RMS");
 	E_e_sm->SetFillColor(3);	// green
 	E_e_sm->Draw();	// Draw histogram
 	cout << "ChiSq = " << fit_sm->Chi2() << endl;
+	if (nbench > 0) compare_fitters(E_e_sm, func);
+	if (freeQ) fit_free_Q(E_e_sm, func, gen, res_0);
+
+	// Fit of E_e_sm with the full covariance matrix (statistical + systematic)
+	if (covfile != "") {
+		TFile *covroot = new TFile(covfile.c_str(), "read");
+		TH2D *V_syst = (TH2D*)covroot->Get("V_syst");
+		if (setup_covfit(E_e_sm, V_syst)) {
+			TMinuit *minuit = new TMinuit(2);
+			minuit->SetFCN(fcn_cov);
+			minuit->SetPrintLevel(-1);
+			int ierflg;
+			minuit->mnparm(0, "m_nu_cov", func->GetParameter(0), 0.01, 0, 0, ierflg);
+			minuit->mnparm(1, "C", func->GetParameter(1), 0.01*func->GetParameter(1), 0, 0, ierflg);	// Start from the fit above
+			minuit->FixParameter(0);	// As in the fit above
+			minuit->Migrad();
+			double par[2], err[2];
+			for (int i=0; i<2; i++) minuit->GetParameter(i, par[i], err[i]);
+			double fmin, fedm, errdef;
+			int npari, nparx, istat;
+			minuit->mnstat(fmin, fedm, errdef, npari, nparx, istat);
+			cout << "Covariance fit: m_nu = " << par[0] << " +- " << err[0] << ", C = " << par[1] << " +- " << err[1] << endl;
+			cout << "ChiSq = " << fmin << " for " << cov_x.size() << " bins" << endl;
+		}
+	}
 }
 
 // Energy distribution for beta decay
 double N(double T_e, double m_nu, double C)
 {
-	return C*sqrt( pow(T_e,2) + 2*T_e*m_e ) * (T_e + m_e) * (Q-T_e) * sqrt( pow(Q-T_e,2) - pow(m_nu,2) ) * F(Z_2,T_e, charge); // Supposing C=1, taken from http://www2.warwick.ac.uk/fac/sci/physics/research/epp/exp/detrd/amber/betaspectrum/ 
+	return model.Eval(T_e, m_nu*m_nu, C, Q);	// Supposing C=1, see bdecay_spectrum.h. With the corrections of the file
+}
+
+// Energy distribution with the endpoint as a parameter, folded with the resolution res (0 = not folded)
+double NQ(double T_e, double m_nu2, double C, double Q_0, double res)
+{
+	return model.Fold(T_e, m_nu2, C, Q_0, res);
 }
 
 // Fermi function
 double F(int Z_2, double T_e, int charge)
 {
-	double eta = (T_e + m_e) * charge * alpha * Z_1 / sqrt(2*T_e*m_e);	// Taken from https://en.wikipedia.org/wiki/Beta_decay#Fermi_function
-	return 2. * Pi * eta / (1 - exp(-2*Pi*eta)); // Taken from https://en.wikipedia.org/wiki/Beta_decay#Fermi_function
+	return F_gen<double>(Z_2, T_e, charge);	// See bdecay_spectrum.h
+}
+
+// Select the E_e_sm bins in the fit range and factorize their covariance matrix V_ij = V_syst_ij y_i y_j + delta_ij y_i
+bool setup_covfit(TH1D *h, TH2D *V_syst)
+{
+	if (!V_syst || V_syst->GetNbinsX() != h->GetNbinsX()) {
+		cout << "Covariance matrix not found in " << covfile << " or its binning differs from E_e_sm" << endl;
+		return false;
+	}
+	vector<int> bins;
+	cov_x.clear();
+	cov_y.clear();
+	for (int i=1; i<=h->GetNbinsX(); i++) {
+		double x = h->GetBinCenter(i);
+		if (x >= fitmin && x <= fitmax) {
+			bins.push_back(i);
+			cov_x.push_back(x);
+			cov_y.push_back(h->GetBinContent(i));
+		}
+	}
+	int n = bins.size();
+	vector<double> V(n*n);
+	for (int i=0; i<n; i++) {
+		for (int j=0; j<n; j++) {
+			V[i*n+j] = V_syst->GetBinContent(bins[i], bins[j]) * cov_y[i]*cov_y[j];	// Systematic part, scaled to the data
+		}
+		V[i*n+i] += max(cov_y[i], 1.);	// Statistical part (Neyman), so that V does not change during the fit
+	}
+	cov_r.resize(n);
+	if (!cov_chi2.Factor(V, n)) {
+		cout << "Covariance matrix is not positive definite" << endl;
+		return false;
+	}
+	return true;
+}
+
+// Minuit function: chi-square with the full covariance matrix, par = (m_nu, C)
+void fcn_cov(int &npar, double *gin, double &f, double *par, int iflag)
+{
+	for (int i=0; i<(int)cov_x.size(); i++) cov_r[i] = cov_y[i] - N(cov_x[i], par[0], par[1]);
+	f = cov_chi2.Eval(&cov_r[0]);
+}
+
+// Same fit as func with the dedicated fitter (m_nu fixed, C free), timed against TH1::Fit over nbench repetitions
+void compare_fitters(TH1D *h, TF1 *func)
+{
+	double m_fit = func->GetParameter(0), C_fit = func->GetParameter(1), chi2_fit = func->GetChisquare();
+
+	// Bins in the fit range, read once
+	vector<double> x, y, err;
+	for (int i=1; i<=h->GetNbinsX(); i++) {
+		double xi = h->GetBinCenter(i);
+		if (xi < fitmin || xi > fitmax) continue;
+		x.push_back(xi);
+		y.push_back(h->GetBinContent(i));
+		err.push_back(h->GetBinError(i));
+	}
+	double C_0 = StartC(model, x, y, m_fit*m_fit, Q, 0.);	// Starting value of C for both fitters, the model of N()
+
+	TStopwatch sw;
+	sw.Start();
+	for (int k=0; k<nbench; k++) {
+		func->SetParameter(1, C_0);
+		h->Fit(func, "RMSQN");	// Options of the fits of bdecay_plot ("RMS"), quiet and not drawn
+	}
+	double t_root = sw.RealTime()/max(nbench, 1);
+
+	BetaFitter fitter;
+	fitter.SetData(x.size(), &x[0], &y[0], &err[0]);
+	model.Apply(fitter);
+	sw.Start();
+	for (int k=0; k<nbench; k++) {
+		fitter.SetParameter(BetaFitter::M2, m_fit*m_fit, true);
+		fitter.SetParameter(BetaFitter::C, C_0);
+		fitter.SetParameter(BetaFitter::Q_E, Q, true);
+		fitter.Fit();
+	}
+	double t_lm = sw.RealTime()/max(nbench, 1);
+
+	cout << "TH1::Fit:   C = " << C_fit << ", ChiSq = " << chi2_fit << ", " << 1e3*t_root << " ms per fit" << endl;
+	cout << "BetaFitter: C = " << fitter.par[BetaFitter::C] << " +- " << fitter.err[BetaFitter::C] << ", ChiSq = " << fitter.chi2 << ", " << 1e3*t_lm << " ms per fit (" << fitter.niter << " iterations)" << endl;
+	func->SetParameter(1, C_fit);	// Leave func as fitted for drawing
+}
+
+// Fit of m_nu^2, C and Q together with the dedicated fitter, whose Jacobian includes the exact dQ derivative (see bdecay_fit.h).
+// The fit range follows the generator endpoint Q_0 and starts at or above GenInfo::FitMin, and the fit starts from func and Q_0
+void fit_free_Q(TH1D *h, TF1 *func, const GenInfo &gen, double res)
+{
+	double Q_0 = gen.Q_0;
+	double lo = gen.FitMin(fitmin-Q+Q_0, res), hi = fitmax-Q+Q_0;
+	if (lo > fitmin-Q+Q_0) cout << "Free Q fit from " << lo << " eV: the generation starts at " << gen.limit << " eV, and the folding reaches " << foldsigma << " res below the fit range" << endl;
+	vector<double> x, y, err;
+	for (int i=1; i<=h->GetNbinsX(); i++) {
+		double xi = h->GetBinCenter(i);
+		if (xi < lo || xi > hi) continue;
+		x.push_back(xi);
+		y.push_back(h->GetBinContent(i));
+		err.push_back(h->GetBinError(i));
+	}
+
+	TStopwatch sw;
+	sw.Start();
+	BetaFitter fitter;
+	fitter.SetData(x.size(), &x[0], &y[0], &err[0]);
+	fitter.SetFolding(res);
+	model.Apply(fitter);
+	fitter.SetParameter(BetaFitter::M2, pow(func->GetParameter(0), 2));
+	fitter.SetParameter(BetaFitter::C, func->GetParameter(1));
+	fitter.SetParameter(BetaFitter::Q_E, Q_0);
+	int status = fitter.Fit();
+	double t = sw.RealTime();
+
+	double rho = fitter.cov[BetaFitter::M2][BetaFitter::Q_E]/(fitter.err[BetaFitter::M2]*fitter.err[BetaFitter::Q_E]);	// Correlation of m_nu^2 and Q
+	cout << "Free Q fit" << (res > 0 ? " (folded, res = " + to_string(res) + " eV)" : "") << ", status " << status << ", " << fitter.niter << " iterations, " << 1e3*t << " ms:" << endl;
+	cout << "  m_nu^2 = " << fitter.par[BetaFitter::M2] << " +- " << fitter.err[BetaFitter::M2] << " eV^2" << endl;
+	cout << "  Q = " << fitter.par[BetaFitter::Q_E] << " +- " << fitter.err[BetaFitter::Q_E] << " eV (generator: " << Q_0 << " eV), correlation with m_nu^2 = " << rho << endl;
+	cout << "  C = " << fitter.par[BetaFitter::C] << " +- " << fitter.err[BetaFitter::C] << ", ChiSq = " << fitter.chi2 << " for " << fitter.ndf << " degrees of freedom" << endl;
+
+	TF1 *func_Q = new TF1(Form("func_Q_%s", h->GetName()), "NQ(x,[0],[1],[2],[3])", lo, hi);
+	func_Q->SetParName(0,"m_nu^2");
+	func_Q->SetParName(1,"C");
+	func_Q->SetParName(2,"Q");
+	func_Q->SetParName(3,"res");
+	func_Q->SetParameters(fitter.par[BetaFitter::M2], fitter.par[BetaFitter::C], fitter.par[BetaFitter::Q_E], res);
+	func_Q->SetLineColor(4);	// blue
+	func_Q->Draw("same");
 }
 
 void gint(TF1 *g) {
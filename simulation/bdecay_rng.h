@@ -0,0 +1,65 @@
+//********************************************************************
+// Counter-based random numbers
+//
+// CounterRng has no state: the k-th random number of a stream is a hash
+// of (key, k). Any thread can draw the numbers of any stream (e.g. one
+// stream per bootstrap replica and bin) in any order and get the same
+// result, so results do not depend on the number of threads or on the
+// order of the work. The hash is two rounds of the SplitMix64 finalizer.
+//********************************************************************
+
+#ifndef BDECAY_RNG_H
+#define BDECAY_RNG_H
+
+#include<cmath>
+#include<stdint.h>
+
+struct CounterRng {
+	uint64_t key;	// Stream identifier
+
+	explicit CounterRng(uint64_t key_) : key(key_) {}
+	CounterRng(uint64_t seed, uint64_t a, uint64_t b) : key(Hash(Hash(seed, a), b)) {}	// Stream number (a, b) of a seed
+
+	static uint64_t Hash(uint64_t k, uint64_t ctr) {
+		uint64_t z = k + 0x9E3779B97F4A7C15ULL*(ctr+1);
+		for (int r=0; r<2; r++) {
+			z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+			z ^= z >> 31;
+			z += k;
+		}
+		return z;
+	}
+
+	// k-th uniform number of the stream, in (0, 1)
+	double Uniform(uint64_t ctr) const { return ((Hash(key, ctr) >> 11) + 0.5)*(1./9007199254740992.); }
+
+	// Poisson random number of mean mu, from the uniforms of the stream starting at counter 0
+	long Poisson(double mu) const {
+		uint64_t ctr = 0;
+		if (mu <= 0) return 0;
+		if (mu < 10) {	// Product of uniforms
+			double L = exp(-mu), p = Uniform(ctr++);
+			long k = 0;
+			while (p > L) {
+				p *= Uniform(ctr++);
+				k++;
+			}
+			return k;
+		}
+		// Transformed rejection with squeeze (Hormann, PTRS)
+		double slam = sqrt(mu), loglam = log(mu);
+		double b = 0.931 + 2.53*slam, a = -0.059 + 0.02483*b;
+		double invalpha = 1.1239 + 1.1328/(b-3.4), vr = 0.9277 - 3.6224/(b-2);
+		while (true) {
+			double U = Uniform(ctr++) - 0.5, V = Uniform(ctr++);
+			double us = 0.5 - fabs(U);
+			long k = long(floor((2*a/us + b)*U + mu + 0.43));
+			if (us >= 0.07 && V <= vr) return k;
+			if (k < 0 || (us < 0.013 && V > us)) continue;
+			if (log(V) + log(invalpha) - log(a/(us*us) + b) <= -mu + k*loglam - lgamma(k+1.)) return k;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,99 @@
+//********************************************************************
+// Inverse-CDF sampling of the beta decay spectrum at any neutrino mass
+//
+// CdfFamily holds one inverse-CDF table of N() per point of a grid of
+// m_nu^2 values, built once. A sample at any m_nu^2 in the grid range is an
+// interpolation between the two neighbouring tables, so scanning m_nu needs
+// no new table.
+//
+// The kinematic cutoff Q - m_nu moves with the mass. Each table is stored in
+// the reduced neutrino momentum s = 1 - p_nu/p_max, where p_max is p_nu at
+// T_e = lo. s always ends at 1 at the cutoff, so interpolating between tables
+// never puts events beyond it, and in p_nu the endpoint behaviour is p_nu^2
+// dp_nu whatever the mass, so neighbouring tables are nearly identical.
+// The tables are indexed by w = 1 - (1-u)^(1/3) instead of the uniform
+// number u: 1-u goes like (1-s)^3, so s(w) is nearly linear.
+//
+// Spectral corrections (bdecay_corrections.h) can be built into the
+// tables, so that sampling costs the same with or without them.
+//
+// Include this file after bdecay_spectrum.h.
+//********************************************************************
+
+#ifndef BDECAY_SAMPLER_H
+#define BDECAY_SAMPLER_H
+
+#include<cmath>
+#include<vector>
+
+#include "bdecay_corrections.h"
+
+struct CdfFamily {
+	double lo, Q_0;	// Energy window [lo, Q_0 - m_nu]
+	double m2max;	// Largest m_nu^2 of the grid (the grid starts at 0)
+	int nm2;	// Number of tables
+	int nq;	// Number of intervals of each table
+	std::vector<double> s;	// nm2 tables of nq+1 reduced energies, at w = i/nq
+
+	// Build the tables, integrating N() on ngrid intervals. With corr, N() is multiplied by the tabulated corrections
+	void Init(double lo_, double Q_0_, double m2max_, int nm2_, int nq_, int ngrid, const CorrectionTable *corr=0) {
+		lo = lo_;
+		Q_0 = Q_0_;
+		m2max = m2max_;
+		nm2 = nm2_;
+		nq = nq_;
+		s.assign(nm2*(nq+1), 0.);
+		std::vector<double> cdf(ngrid+1);
+		for (int k=0; k<nm2; k++) {
+			double m2 = nm2>1 ? m2max*k/(nm2-1) : 0.;
+			double p_max = sqrt((Q_0-lo)*(Q_0-lo) - m2);
+
+			// Cumulative integral of N() in s, trapezoid rule. dT_e/ds = p_nu p_max/E_nu
+			cdf[0] = 0;
+			double prev = N_gen<double>(lo, m2, 1., Q_0) * p_max*p_max/(Q_0-lo) * (corr ? corr->Eval(lo) : 1.);
+			for (int j=1; j<=ngrid; j++) {
+				double p = (1 - 1.*j/ngrid)*p_max;
+				double E_nu = sqrt(p*p + m2);
+				double cur = p>0 ? N_gen<double>(Q_0 - E_nu, m2, 1., Q_0) * p*p_max/E_nu * (corr ? corr->Eval(Q_0 - E_nu) : 1.) : 0.;
+				cdf[j] = cdf[j-1] + 0.5*(prev+cur);
+				prev = cur;
+			}
+
+			// Invert at u = 1-(1-w)^3, w = i/nq
+			double *sk = &s[k*(nq+1)];
+			int j = 0;
+			for (int i=0; i<=nq; i++) {
+				double w = 1.*i/nq;
+				double u = (1 - (1-w)*(1-w)*(1-w)) * cdf[ngrid];
+				while (j < ngrid-1 && cdf[j+1] < u) j++;
+				double f = cdf[j+1]>cdf[j] ? (u-cdf[j])/(cdf[j+1]-cdf[j]) : 0.;
+				sk[i] = (j + std::min(std::max(f,0.),1.))/ngrid;
+			}
+			sk[0] = 0;
+			sk[nq] = 1;
+		}
+	}
+
+	// Kinetic energy for the uniform number u in [0,1) and squared neutrino mass m_nu2 in [0, m2max].
+	// Above m2max the last table would be used with the cutoff of m_nu2, which is wrong: callers keep m_nu2 in range
+	double Sample(double u, double m_nu2) const {
+		double w = 1 - cbrt(1-u);
+		double x = w*nq;
+		int i = std::min(int(x), nq-1);
+		double f = x - i;
+		double y = nm2>1 ? std::min(std::max(m_nu2,0.)/m2max, 1.)*(nm2-1) : 0.;
+		int k = std::min(int(y), std::max(nm2-2, 0));
+		double t = y - k;
+		const double *s0 = &s[k*(nq+1)];
+		double sr = s0[i] + f*(s0[i+1]-s0[i]);
+		if (t > 0) {
+			const double *s1 = s0 + nq+1;
+			sr += t*(s1[i] + f*(s1[i+1]-s1[i]) - sr);
+		}
+		double m2 = std::max(m_nu2,0.);
+		double p = (1-sr)*sqrt((Q_0-lo)*(Q_0-lo) - m2);	// Neutrino momentum
+		return Q_0 - sqrt(p*p + m2);
+	}
+};
+
+#endif
@@ -0,0 +1,215 @@
+//********************************************************************
+// Fit window scan of the beta decay spectrum
+// Uses a pre-existing beta decay spectrum
+//
+// Fits m_nu^2 (with C free) in every window [lo, hi] of a 2D grid of lower
+// and upper bounds, and maps the result to check its stability. For each
+// m_nu^2 of a grid, the sums sum w y^2, sum w y N and sum w N^2 are
+// accumulated once over the bins (prefix sums), so the chi-square of any
+// window, with C profiled analytically, costs O(1):
+//   chi2 = Syy - Syf^2/Sff
+// The m_nu^2 of the lowest chi-square is refined with a parabola, whose
+// curvature gives the error. Windows are shared among threads.
+// The model is that of the generation (endpoint, resolution, corrections
+// and isotope read from the file), and the bounds follow its endpoint.
+// Windows starting below limit + foldsigma*res (GenInfo::FitMin), where
+// the folded model is biased, are left empty.
+//
+// To run, do <root -l 'bdecay_scan.cpp("filename")'>
+// Output (in filename_scan.root): TH2D m2_map, m_nu_map, sigma_map and
+// chi2ndf_map, with the lower bound on x and the upper bound on y
+//********************************************************************
+
+// C++ libs
+#include <iostream>
+#include<stdlib.h>	//rand, srand
+#include<cmath>
+#include<vector>
+#include<thread>
+
+// ROOT libs
+#include<TH1D.h>
+#include<TH2D.h>
+#include<TFile.h>
+#include<TMath.h>
+#include<TCanvas.h>
+#include<TStyle.h>
+
+using namespace std;
+
+////////////////// Parameters ///////////////////////
+// Initial nucleus
+const int Z_1 = 1;	// Atomic number of initial nucleus (3H)
+const double m_1 = 3.0160492;	// Isotope mass (in atomic mass units)
+
+// Final nucleus
+const int Z_2 = 2;	// Atomic number of final nucleus (3He)
+const double m_2 = 3.0160293;	// Isotope mass (in atomic mass units)
+
+// Other parameters
+const int charge = -1;
+const double Q = 18590; // Katrin Q Value (in eV)
+const string histname = "E_e_sm";	// Histogram to fit
+const double res = -1;	// Resolution (in eV) of the folded model (-1 = that of the generation, 0 = fit with N() itself, as bdecay_plot.cpp)
+const double lo_min = Q-25, lo_max = Q-5;	// Range of the lower bound of the fit window (relative to the generator Q, as in bdecay_plot.cpp)
+const double hi_min = Q-4, hi_max = Q+2;	// Range of the upper bound of the fit window
+const int nlo = 41, nhi = 31;	// Number of lower and upper bounds
+const double m2_min = -4, m2_max = 4;	// Range of the m_nu^2 grid (in eV^2)
+const int nm2 = 801;	// Number of m_nu^2 values
+const int nthreads = 0;	// Number of threads (0 = number of cores)
+////////////////// End Of Parameters ///////////////
+
+// Physical Constants
+const double Pi = 3.14159265;	// Pi
+const double alpha = 1./137;	// Structure constant
+const double m_e = 0.510998910e6;	// Mass (in eV) of electron. From Wikipedia.
+
+// Spectrum kernels, generic over the scalar type (needs the constants above)
+#include "bdecay_spectrum.h"
+#include "bdecay_fit.h"
+
+// Prefix sums over the bins: element i is the sum over the first i bins
+vector<double> Syy;	// sum w y^2
+vector< vector<double> > Syf;	// sum w y f, for each m_nu^2
+vector< vector<double> > Sff;	// sum w f^2, for each m_nu^2
+
+// Functions
+void scan_window(int, int, double*);
+
+// Main program
+void bdecay_scan(string filename){
+	gStyle->SetOptStat(0);
+	int nth = nthreads>0 ? nthreads : max(1u, thread::hardware_concurrency());
+
+	// ROOT rootfile
+	TFile *rootfile = new TFile((filename + ".root").c_str(), "read");
+	TH1D *h = (TH1D*)rootfile->Get(histname.c_str());
+	int nbins = h->GetNbinsX();
+
+	// Model of the generation, over all the windows
+	GenInfo gen = ReadGenInfo(rootfile, Q, h->GetXaxis()->GetXmin());
+	double Q_0 = gen.Q_0, r = res >= 0 ? res : gen.res, shift = Q_0 - Q;
+	SpectrumModel model;
+	string error;
+	if (!model.Init(gen.corrections, gen.isotope, lo_min+shift, hi_max+shift, Q_0, r, error)) {
+		cout << filename << ".root: " << error << endl;
+		return;
+	}
+	cout << "Q = " << Q_0 << " eV, res = " << r << " eV";
+	if (gen.corrections != "") cout << ", corrections " << gen.corrections;
+	if (gen.isotope != "") cout << ", isotope " << gen.isotope;
+	cout << endl;
+	double lo_first = gen.FitMin(lo_min+shift, r);	// Lowest unbiased lower bound
+	if (lo_first > lo_min+shift) cout << "Windows from below " << lo_first << " eV left empty: the generation starts at " << gen.limit << " eV, and the folding reaches " << foldsigma << " res below the window" << endl;
+
+	// Prefix sums, one m_nu^2 per thread at a time
+	Syy.assign(nbins+1, 0.);
+	for (int i=1; i<=nbins; i++) {
+		double e = h->GetBinError(i), y = h->GetBinContent(i);
+		Syy[i] = Syy[i-1] + (e > 0 ? y*y/(e*e) : 0.);
+	}
+	Syf.assign(nm2, vector<double>(nbins+1, 0.));
+	Sff.assign(nm2, vector<double>(nbins+1, 0.));
+	vector<thread> threads;
+	for (int t=0; t<nth; t++) {
+		threads.push_back(thread([&, t]() {
+			for (int k=t; k<nm2; k+=nth) {
+				double m2 = m2_min + (m2_max-m2_min)*k/(nm2-1);
+				for (int i=1; i<=nbins; i++) {
+					double x = h->GetBinCenter(i), e = h->GetBinError(i), y = h->GetBinContent(i);
+					double f = model.Fold(x, m2, 1., Q_0, r);
+					double w = e > 0 ? 1./(e*e) : 0.;	// Empty bins are ignored, as in TH1::Fit
+					Syf[k][i] = Syf[k][i-1] + w*y*f;
+					Sff[k][i] = Sff[k][i-1] + w*f*f;
+				}
+			}
+		}));
+	}
+	for (int t=0; t<nth; t++) threads[t].join();
+
+	// ROOT Histograms of the scan
+	double dlo = nlo>1 ? (lo_max-lo_min)/(nlo-1) : 1, dhi = nhi>1 ? (hi_max-hi_min)/(nhi-1) : 1;
+	double lo_0 = lo_min+shift, lo_1 = lo_max+shift, hi_0 = hi_min+shift, hi_1 = hi_max+shift;	// Bounds at the generator endpoint
+	TH2D *m2_map = new TH2D("m2_map", "m_{#nu}^{2} [eV^{2}];Lower bound [eV];Upper bound [eV]", nlo, lo_0-dlo/2, lo_1+dlo/2, nhi, hi_0-dhi/2, hi_1+dhi/2);
+	TH2D *m_nu_map = new TH2D("m_nu_map", "m_{#nu} [eV];Lower bound [eV];Upper bound [eV]", nlo, lo_0-dlo/2, lo_1+dlo/2, nhi, hi_0-dhi/2, hi_1+dhi/2);
+	TH2D *sigma_map = new TH2D("sigma_map", "#sigma(m_{#nu}^{2}) [eV^{2}];Lower bound [eV];Upper bound [eV]", nlo, lo_0-dlo/2, lo_1+dlo/2, nhi, hi_0-dhi/2, hi_1+dhi/2);
+	TH2D *chi2ndf_map = new TH2D("chi2ndf_map", "#chi^{2}/ndf;Lower bound [eV];Upper bound [eV]", nlo, lo_0-dlo/2, lo_1+dlo/2, nhi, hi_0-dhi/2, hi_1+dhi/2);
+
+	// Fits of all windows, in parallel over the lower bounds
+	vector<double> result(nlo*nhi*4, 0.);	// m_nu^2, sigma, chi2/ndf, ndf of each window
+	threads.clear();
+	for (int t=0; t<nth; t++) {
+		threads.push_back(thread([&, t]() {
+			for (int a=t; a<nlo; a+=nth) {
+				double lo = lo_0 + a*dlo;
+				if (lo < lo_first - 1e-6*dlo) continue;	// Empty windows (ndf = 0)
+				int i1 = max(h->FindBin(lo), 1) - 1;	// Window = bins i1+1 to i2 (bins with center in [lo, hi])
+				if (h->GetBinCenter(i1+1) < lo) i1++;
+				for (int b=0; b<nhi; b++) {
+					double hi = hi_0 + b*dhi;
+					int i2 = min(h->FindBin(hi), nbins);
+					if (h->GetBinCenter(i2) > hi) i2--;
+					scan_window(i1, i2, &result[4*(a*nhi+b)]);
+				}
+			}
+		}));
+	}
+	for (int t=0; t<nth; t++) threads[t].join();
+
+	for (int a=0; a<nlo; a++) {
+		for (int b=0; b<nhi; b++) {
+			double *r = &result[4*(a*nhi+b)];
+			if (r[3] <= 0) continue;	// Not enough bins
+			m2_map->SetBinContent(a+1, b+1, r[0]);
+			m_nu_map->SetBinContent(a+1, b+1, r[0] >= 0 ? sqrt(r[0]) : -sqrt(-r[0]));	// Negative for an unphysical m_nu^2 < 0
+			sigma_map->SetBinContent(a+1, b+1, r[1]);
+			chi2ndf_map->SetBinContent(a+1, b+1, r[2]);
+		}
+	}
+
+	TCanvas *c1=new TCanvas("m_nu_map","m_nu_map");	// ROOT canvas creation
+	m_nu_map->Draw("colz");
+
+	TFile *outfile = new TFile((filename + "_scan.root").c_str(), "recreate");
+	m2_map->Write();
+	m_nu_map->Write();
+	sigma_map->Write();
+	chi2ndf_map->Write();
+	outfile->Close();
+}
+
+// Fit of the window made of bins i1+1 to i2, from the prefix sums. r = (m_nu^2, sigma, chi2/ndf, ndf)
+void scan_window(int i1, int i2, double *r)
+{
+	r[3] = i2 - i1 - 2;	// Two parameters, m_nu^2 and C
+	if (r[3] <= 0) return;
+	double yy = Syy[i2] - Syy[i1];
+
+	// Profiled chi-square on the m_nu^2 grid
+	int kmin = 0;
+	double chi2min = 1e300;
+	vector<double> chi2(nm2);
+	for (int k=0; k<nm2; k++) {
+		double yf = Syf[k][i2] - Syf[k][i1], ff = Sff[k][i2] - Sff[k][i1];
+		chi2[k] = ff > 0 ? yy - yf*yf/ff : yy;
+		if (chi2[k] < chi2min) {
+			chi2min = chi2[k];
+			kmin = k;
+		}
+	}
+
+	// Parabola through the lowest point and its neighbours
+	double step = (m2_max-m2_min)/(nm2-1);
+	double m2 = m2_min + kmin*step, curv = 0;
+	if (kmin > 0 && kmin < nm2-1) {
+		curv = (chi2[kmin+1] - 2*chi2[kmin] + chi2[kmin-1])/(step*step);
+		if (curv > 0) {
+			double shift = -0.5*(chi2[kmin+1] - chi2[kmin-1])/(step*step*curv);	// In grid steps, within [-1/2, 1/2]
+			m2 += shift*step;
+			chi2min += 0.25*(chi2[kmin+1] - chi2[kmin-1])*shift;
+		}
+	}
+	r[0] = m2;
+	r[1] = curv > 0 ? sqrt(2./curv) : 0.;	// Delta chi2 = 1
+	r[2] = chi2min/r[3];
+}
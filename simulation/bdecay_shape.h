@@ -0,0 +1,167 @@
+//********************************************************************
+// Beta spectra of other isotopes, with forbidden shape factors
+//
+// N_gen() is the allowed spectrum of tritium. ShapeSpectrum is the
+// spectrum of an isotope of the table below, allowed or first unique
+// forbidden (e.g. 187Re, 5/2+ -> 1/2-):
+//	N = C p_e W_e F0(Z, W) E_nu p_nu S,	S = 1 (allowed)
+//						S = p_nu^2 + lambda_2 p_e^2 (unique first forbidden)
+// with the relativistic Fermi functions F0 and F1 of a uniformly charged
+// nucleus, and lambda_2 = F1/F0 (Behrens & Buhring). These need complex
+// Gamma functions, so the parts that only depend on the electron energy,
+//	a(T_e) = p_e W_e F0 and b(T_e) = a lambda_2 p_e^2,
+// are either evaluated exactly or tabulated once with the Fermi function
+// on a fine grid over the window (Isotope::tabulated). The endpoint
+// factors E_nu p_nu (p_nu^2), which depend on m_nu and Q, are always
+// exact, so one table serves every mass and endpoint of a scan or fit,
+// and a tabulated spectrum costs about as much as the tritium one.
+//
+// Include this file after bdecay_spectrum.h.
+//********************************************************************
+
+#ifndef BDECAY_SHAPE_H
+#define BDECAY_SHAPE_H
+
+#include<cmath>
+#include<complex>
+#include<string>
+#include<vector>
+#include<type_traits>
+
+struct Isotope {
+	const char *name;
+	int Z;	// Atomic number of the daughter nucleus
+	int A;	// Mass number, for the nuclear radius 1.2 A^(1/3) fm
+	double Q;	// Endpoint (in eV)
+	int forbidden;	// 0 = allowed, 1 = first unique forbidden
+	bool tabulated;	// Tabulate the energy dependent parts (false = evaluate them exactly at every call)
+};
+
+const Isotope isotopes[] = {
+	{"3H", 2, 3, 18591, 0, true},
+	{"63Ni", 29, 63, 66977, 0, true},
+	{"187Re", 76, 187, 2466.7, 1, true},
+};
+
+// Isotope of the table by name, 0 if there is none
+inline const Isotope* find_isotope(const std::string &name)
+{
+	for (size_t i=0; i<sizeof(isotopes)/sizeof(isotopes[0]); i++) {
+		if (name == isotopes[i].name) return &isotopes[i];
+	}
+	return 0;
+}
+
+// log Gamma(z) for complex z, Lanczos approximation (g = 7, 9 terms), relative error about 1e-15
+inline std::complex<double> lgamma_complex(std::complex<double> z)
+{
+	const double pi = acos(-1.);
+	if (z.real() < 0.5) return log(pi/sin(pi*z)) - lgamma_complex(1.-z);	// Reflection
+	static const double c[9] = {0.99999999999980993, 676.5203681218851, -1259.1392167224028, 771.32342877765313, -176.61502916214059,
+		12.507343278686905, -0.13857109526572012, 9.9843695780195716e-6, 1.5056327351493116e-7};
+	z -= 1.;
+	std::complex<double> x = c[0];
+	for (int i=1; i<9; i++) x += c[i]/(z + double(i));
+	std::complex<double> t = z + 7.5;
+	return 0.5*log(2*pi) + (z + 0.5)*log(t) - t + log(x);
+}
+
+// Generalized Fermi function F_{k-1}(Z, W) of a beta- decay, R the nuclear radius (W, p, R in units of m_e). F_0 is the usual one
+inline double fermi_k(int k, int Z, double W, double R)
+{
+	const double pi = acos(-1.);
+	double p = sqrt(W*W - 1), aZ = alpha*Z, eta = aZ*W/p, g = sqrt(k*k - aZ*aZ);
+	double df = 1;	// (2k-1)!!
+	for (int j=2*k-1; j>1; j-=2) df *= j;
+	double lnF = 2*log(k*df) + k*log(4.) + 2*(g-k)*log(2*p*R) + pi*eta + 2*lgamma_complex(std::complex<double>(g, eta)).real() - 2*lgamma(1+2*g);
+	return exp(lnF);
+}
+
+class ShapeSpectrum {
+public:
+	ShapeSpectrum() : iso(0), lo(0), hi(0), step(1), R(0), maxerr(0) {}
+
+	// Spectrum of the isotope i over the window [lo, hi], tabulated on n intervals if i.tabulated
+	void Init(const Isotope &i, double lo_, double hi_, int n) {
+		iso = &i;
+		lo = lo_;
+		hi = hi_;
+		R = 1.2*pow(double(i.A), 1./3)/386.15926;
+		a.clear();
+		b.clear();
+		maxerr = 0;
+		if (!i.tabulated) return;
+		step = (hi-lo)/n;
+		a.resize(n+1);
+		b.resize(n+1);
+		for (int k=0; k<=n; k++) Exact(lo + k*step, a[k], b[k]);
+		for (int k=0; k<n; k++) {
+			double ae, be;
+			Exact(lo + (k+0.5)*step, ae, be);
+			if (ae > 0) maxerr = std::max(maxerr, fabs(0.5*(a[k]+a[k+1])/ae - 1));
+			if (be > 0) maxerr = std::max(maxerr, fabs(0.5*(b[k]+b[k+1])/be - 1));
+		}
+	}
+
+	bool Empty() const { return iso == 0; }
+	const Isotope& Iso() const { return *iso; }
+
+	// N(T_e) for the squared neutrino mass m_nu2 and the endpoint Q_0, with T = double or Dual<n> (see bdecay_dual.h)
+	template<typename T>
+	T Eval(T T_e, T m_nu2, T C, T Q_0) const {
+		T E_nu = Q_0 - T_e;
+		T p_nu2 = E_nu*E_nu - m_nu2;
+		if (value(T_e) <= 0 || value(E_nu) <= 0 || value(p_nu2) <= 0) return T(0.);
+		double av, bv, da, db;	// a, b and their derivatives in T_e
+		Smooth(value(T_e), av, bv, da, db, !std::is_same<T, double>::value);
+		T dT = T_e - T(value(T_e));	// Derivatives of T_e only (e.g. with respect to res in a folding)
+		T s = T(av) + dT*da;
+		if (iso->forbidden) s = s*p_nu2 + T(bv) + dT*db;
+		return C * s * E_nu * sqrt(p_nu2);
+	}
+	double operator()(double T_e, double m_nu2, double C, double Q_0) const { return Eval<double>(T_e, m_nu2, C, Q_0); }
+
+	const Isotope *iso;
+	double lo, hi;	// Window of the tables
+	double step;	// Grid step
+	double R;	// Nuclear radius (in units of hbar/(m_e c))
+	std::vector<double> a, b;	// Tables of a(T_e) and b(T_e) at lo + k*step (if tabulated)
+	double maxerr;	// Maximum relative error of the interpolation of a and b, measured at the midpoints
+
+private:
+	// a(T_e) and b(T_e) from the Fermi functions
+	void Exact(double T_e, double &av, double &bv) const {
+		av = bv = 0;
+		if (T_e <= 0) return;
+		double W = 1 + T_e/m_e, pe = sqrt(T_e*T_e + 2*T_e*m_e);
+		double F0 = fermi_k(1, iso->Z, W, R);
+		av = pe * (T_e + m_e) * F0;
+		bv = iso->forbidden ? pe * (T_e + m_e) * fermi_k(2, iso->Z, W, R) * pe*pe : 0.;	// a lambda_2 p_e^2
+	}
+
+	// a(T_e) and b(T_e), from the tables or exact, and with deriv their derivatives
+	void Smooth(double T_e, double &av, double &bv, double &da, double &db, bool deriv) const {
+		da = db = 0;
+		if (a.empty()) {
+			Exact(T_e, av, bv);
+			if (deriv) {	// Central differences
+				double h = 1e-4*std::max(T_e, 1.), a1, b1, a2, b2;
+				Exact(T_e + h, a1, b1);
+				Exact(std::max(T_e - h, 0.5*T_e), a2, b2);
+				double d = T_e + h - std::max(T_e - h, 0.5*T_e);
+				da = (a1 - a2)/d;
+				db = (b1 - b2)/d;
+			}
+			return;
+		}
+		double x = std::min(std::max((T_e - lo)/step, 0.), double(a.size()-1));
+		int k = std::min(int(x), int(a.size())-2);
+		double f = x - k;
+		av = a[k] + f*(a[k+1]-a[k]);
+		bv = b[k] + f*(b[k+1]-b[k]);
+		da = (a[k+1]-a[k])/step;
+		db = (b[k+1]-b[k])/step;
+	}
+};
+
+#endif
@@ -0,0 +1,170 @@
+//********************************************************************
+// Live snapshots of the generator histograms in POSIX shared memory
+//
+// The segment holds a header and two snapshot buffers. The generator
+// (one writer, its monitoring loop) always writes the buffer that readers
+// are not directed to, then increments the sequence number, which flips
+// the buffer readers use. A reader copies the current buffer and checks
+// the number of snapshots the writer has started: if the writer has not
+// started on that buffer again in the meantime (at most one snapshot
+// started since) the copy is consistent, otherwise it retries. Nobody takes a lock, and the generator
+// threads are not involved at all.
+//
+// Layout: ShmHeader, then 2 x (ShmFrame, E_e[nbins+2], E_e_sm[nbins+2])
+//********************************************************************
+
+#ifndef BDECAY_SHM_H
+#define BDECAY_SHM_H
+
+#include<atomic>
+#include<string>
+#include<vector>
+#include<cstring>
+#include<stdint.h>
+#include<fcntl.h>	// shm_open
+#include<unistd.h>	// ftruncate, close
+#include<sys/mman.h>	// mmap
+
+const uint64_t shm_magic = 0x6264656361790004ULL;	// "bdecay" and layout version
+
+struct ShmHeader {
+	uint64_t magic;
+	int nbins;	// Histogram bins (without underflow and overflow)
+	double lo, hi;	// Histogram range
+	double Q, res;	// Generator endpoint and resolution
+	double limit;	// Lower edge of the generated true energies
+	char corrections[256];	// Spectral corrections of the generation, see bdecay_corrections.h
+	char isotope[32];	// Isotope of the generation (empty = N()), see bdecay_shape.h
+	std::atomic<uint64_t> seq;	// Number of snapshots published. Readers use buffer seq%2
+	std::atomic<uint64_t> wseq;	// Number of snapshots started
+	std::atomic<int> done;	// Set when the generation is over
+};
+
+// Counters of one snapshot
+struct ShmFrame {
+	long nevents;	// Events generated
+	double elapsed;	// Seconds since the start of the generation
+	double Q_eff;	// Online endpoint estimate
+	double tail;	// Smeared events in the last eV below Q_eff
+};
+
+class ShmSnapshot {
+public:
+	ShmSnapshot() : base(0), size(0), owner(false) {}
+	~ShmSnapshot() { Close(); }
+
+	// Create the segment (generator side). False if it cannot be created, or if the corrections or the isotope do not fit in the header
+	bool Create(const std::string &name_, int nbins, double lo, double hi, double Q, double res, double limit, const std::string &corrections, const std::string &isotope) {
+		if (corrections.size() >= sizeof(ShmHeader::corrections) || isotope.size() >= sizeof(ShmHeader::isotope)) return false;
+		name = name_;
+		size = sizeof(ShmHeader) + 2*Frame_size(nbins);
+		int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+		if (fd < 0) return false;
+		if (ftruncate(fd, size) != 0) {
+			close(fd);
+			return false;
+		}
+		base = (char*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (base == MAP_FAILED) {
+			base = 0;
+			return false;
+		}
+		owner = true;
+		ShmHeader *hd = Writable();
+		hd->nbins = nbins;
+		hd->lo = lo;
+		hd->hi = hi;
+		hd->Q = Q;
+		hd->res = res;
+		hd->limit = limit;
+		strcpy(hd->corrections, corrections.c_str());
+		strcpy(hd->isotope, isotope.c_str());
+		hd->seq.store(0);
+		hd->wseq.store(0);
+		hd->done.store(0);
+		memset(base + sizeof(ShmHeader), 0, 2*Frame_size(nbins));
+		std::atomic_thread_fence(std::memory_order_release);
+		hd->magic = shm_magic;	// Last, so that a reader never sees a half-initialized header
+		return true;
+	}
+
+	// Attach to an existing segment (monitor side)
+	bool Attach(const std::string &name_) {
+		name = name_;
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if (fd < 0) return false;
+		ShmHeader hd;
+		if (pread(fd, &hd, sizeof(uint64_t) + sizeof(int), 0) != (ssize_t)(sizeof(uint64_t) + sizeof(int)) || hd.magic != shm_magic) {
+			close(fd);
+			return false;
+		}
+		size = sizeof(ShmHeader) + 2*Frame_size(hd.nbins);
+		base = (char*)mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (base == MAP_FAILED) {
+			base = 0;
+			return false;
+		}
+		return true;
+	}
+
+	// Publish a snapshot: E_e and E_e_sm have nbins+2 bins (with underflow and overflow)
+	void Publish(const ShmFrame &frame, const double *E_e, const double *E_e_sm) {
+		ShmHeader *hd = Writable();
+		uint64_t s = hd->seq.load(std::memory_order_relaxed);
+		hd->wseq.store(s+1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);	// Readers see wseq before any change of the buffer
+		char *buf = Buffer((s+1)%2);	// The buffer readers are not using
+		int n = hd->nbins + 2;
+		memcpy(buf, &frame, sizeof(ShmFrame));
+		memcpy(buf + sizeof(ShmFrame), E_e, n*sizeof(double));
+		memcpy(buf + sizeof(ShmFrame) + n*sizeof(double), E_e_sm, n*sizeof(double));
+		hd->seq.store(s+1, std::memory_order_release);
+	}
+
+	void Finish() { Writable()->done.store(1, std::memory_order_release); }
+
+	// Copy the latest snapshot. Returns false if nothing was published yet or no consistent copy could be made
+	bool Read(ShmFrame &frame, std::vector<double> &E_e, std::vector<double> &E_e_sm, int maxtry=100) const {
+		const ShmHeader *hd = Header();
+		int n = hd->nbins + 2;
+		E_e.resize(n);
+		E_e_sm.resize(n);
+		for (int k=0; k<maxtry; k++) {
+			uint64_t s = hd->seq.load(std::memory_order_acquire);
+			if (s == 0) return false;
+			const char *buf = Buffer(s%2);
+			memcpy(&frame, buf, sizeof(ShmFrame));
+			memcpy(&E_e[0], buf + sizeof(ShmFrame), n*sizeof(double));
+			memcpy(&E_e_sm[0], buf + sizeof(ShmFrame) + n*sizeof(double), n*sizeof(double));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (hd->wseq.load(std::memory_order_relaxed) <= s+1) return true;	// The writer did not come back to this buffer
+		}
+		return false;
+	}
+
+	bool IsOpen() const { return base != 0; }
+	const ShmHeader* Header() const { return (const ShmHeader*)base; }
+	bool Done() const { return Header()->done.load(std::memory_order_acquire); }
+
+	void Close() {
+		if (base) munmap(base, size);
+		if (owner) shm_unlink(name.c_str());
+		base = 0;
+		owner = false;
+	}
+
+private:
+	char *base;	// Mapped segment
+	size_t size;
+	bool owner;	// The creator removes the segment
+	std::string name;
+
+	ShmHeader* Writable() { return (ShmHeader*)base; }
+	static size_t Frame_size(int nbins) { return sizeof(ShmFrame) + 2*(nbins+2)*sizeof(double); }
+	char* Buffer(int k) { return base + sizeof(ShmHeader) + k*Frame_size(Writable()->nbins); }
+	const char* Buffer(int k) const { return base + sizeof(ShmHeader) + k*Frame_size(Header()->nbins); }
+};
+
+#endif
@@ -9,12 +9,20 @@
 #include <iostream>
 #include<stdlib.h>	//rand, srand
 #include<cmath>
+#include<vector>
+#include<thread>
+#include<atomic>
+#include<chrono>
+#include<mutex>
 
 // ROOT libs
 #include<TH1D.h>
 #include<TFile.h>
 #include<TMath.h>
 #include<TRandom3>
+#include<TParameter.h>
+#include<TNamed.h>
+#include<TStopwatch.h>
 
 using namespace std;
 
@@ -31,11 +39,48 @@ const double m_2 = 3.0160293;	// Isotope mass (in atomic mass  units)
 const int charge = -1;
 //const double Q = 931.494095e6*(m_1-m_2);
 const double Q = 18590; // Katrin Q Value (in eV)
-const int nevents = 1e7;// Number of events to generate
+const int nevents = 1e7;// Number of events to generate (the maximum, if stopmode > 0)
+const int stopmode = 0;	// 0 = generate nevents, 1 = stop at stop_tail events in [Q-1, Q], 2 = stop when the expected sigma(m_nu^2) is below stop_sigma, 3 = same with the error of the online fit
+const double stop_tail = 1000;	// Target number of smeared events in the last eV (stopmode 1)
+const double stop_sigma = 0.1;	// Target statistical error on m_nu^2, in eV^2 (stopmode 2 and 3)
+const double activity = 0;	// Source activity (in Bq). If > 0, the number of events is drawn from the exposure instead of nevents, and the histograms are in counts/s
+const double livetime = 3.15e7;	// Measurement time (in s), used if activity > 0
 const double res = 1;	// Resolution of detector (in eV)
 const double h = 0.00002;	// Constant used for Von Neuman method. Should range about [1,10]. Too low => cutting distribution, Too high => execution takes too long. Used to estimate the maximum of N(T_e)
 double limit=(Q-25)/Q;	// Number between 0 and 1. Fraction of Q over which we necessitate the energy to be 
 const int ndivisions = 100;	// Number of divisions in energy histograms
+const int chebyshev = 6;	// Order of the Chebyshev surrogate of N() used in the generation loop (0 = exact N())
+const int sampler = 0;	// 0 = Von Neumann acceptance-rejection, 1 = inverse CDF tables interpolated in m_nu^2, 2 = Von Neumann with the spectrum of isotope
+const string engine = "";	// Generator policies "rng:sampler:smear:real" (see bdecay_generator.h), e.g. "counter:cdf:gauss:float". Empty = "trandom3", sampler and chebyshev above, "gauss", "double". The "cheb" sampler uses the order chebyshev
+const double cdf_m2max = 1.;	// Largest m_nu^2 (in eV^2) of the inverse CDF tables
+const int cdf_nm2 = 21;	// Number of inverse CDF tables, from m_nu^2 = 0 to cdf_m2max
+const int cdf_nq = 4096;	// Number of intervals of each inverse CDF table
+const string corrections = "";	// Spectral corrections applied to N() in the generation, e.g. "radiative,screening,finitesize,recoil,wm" (see bdecay_corrections.h)
+const int corr_nbins = 4096;	// Number of intervals of the table of the product of the corrections over the window
+const string isotope = "3H";	// Isotope of the "shape" sampler (see bdecay_shape.h), e.g. "187Re" (first unique forbidden). Set Q and limit to its window
+const int shape_table = -1;	// Energy dependent parts of its spectrum: -1 = as set for the isotope, 0 = exact, 1 = tabulated
+const int shape_nbins = 4096;	// Number of intervals of its tables
+const int nthreads = 0;	// Number of generator threads (0 = number of cores)
+const unsigned long seed = 0;	// Base seed of the run (0 = from the clock, printed and saved so that the run can be repeated). The seed of each thread is a hash of it and the thread number
+const bool numa = false;	// Pin the threads to CPUs spread over the NUMA nodes, with a copy of the sampling tables per node (Linux). See bdecay_numa.h
+const double finebin = 0.;	// Bin width (in eV) of the sparse E_e_sm histogram over [0, Q+10] (0 = not filled), e.g. 0.001
+const double fine_lo = Q-5;	// Region of the sparse histogram written as the dense histogram E_e_sm_fine
+const double fine_hi = Q+2;
+const int nlevels = 0;	// Number of levels of the multi-resolution histograms E_e_L<l> and E_e_sm_L<l> (0 = not filled). Set limit to 0 to cover [0, Q] in one pass
+const double level_lo[] = {0., Q-1000, Q-25, Q-2};	// Lower edge of each level, from the coarsest to the finest
+const int level_nbins[] = {186, 1000, 250, 400};	// Number of bins of each level
+const double level_hi = Q+5;	// Upper edge of all levels
+const int nres = 0;	// Number of extra resolutions applied to the same true energies, histograms E_e_sm_r<k> (0 = none). Needs the gauss smearing
+const double res_scan[] = {0.5, 0.75, 1., 1.25, 1.5, 2.};	// Resolutions (in eV) of the extra smeared histograms
+const double telemetry = 10;	// Seconds between two telemetry lines with the online endpoint estimate (0 = no telemetry)
+const int topk = 1000;	// Number of highest smeared energies kept by the endpoint estimator
+const string shm_name = "";	// POSIX shared-memory segment with live snapshots of E_e and E_e_sm, e.g. "/bdecay" (empty = none). See bdecay_monitor.cpp
+const double snapshot = 1;	// Seconds between two snapshots
+const double onlinefit = 0;	// Seconds between two fits of m_nu^2 in the merged E_e_sm, on a background thread during the generation (0 = none, 1 s if stopmode = 3)
+const double fitmin = Q-20;	// Fit range of the online fit. Keep it a few res above limit, where the smeared spectrum is cut by the generation window
+const double fitmax = Q-0.2;
+const double abort_pull = 5;	// Abort the generation when the online fit is more than abort_pull sigma away from the generated m_nu^2 (0 = never)
+const double abort_chi2 = 3;	// Abort the generation when the chi2/ndf of the online fit is above abort_chi2 (0 = never)
 ////////////////// End Of Parameters ///////////////
 
 // Physical Constants
@@ -46,17 +91,92 @@ const double m_n = 939.5654133e6;	// Mass (in eV) of neutron. From Wikipedia.
 const double m_e = 0.510998910e6;	// Mass (in eV) of electron. From Wikipedia.
 const double m_nu= 0.2;	// Mass (in eV) of neutrino. Value was given in our project synopsis
 
+// Spectrum kernels, generic over the scalar type (needs the constants above)
+#include "bdecay_spectrum.h"
+#include "bdecay_sampler.h"
+#include "bdecay_histo.h"
+#include "bdecay_online.h"
+#include "bdecay_shm.h"
+#include "bdecay_fit.h"
+#include "bdecay_generator.h"
+#include "bdecay_numa.h"
+
+// Generator state of one thread
+struct Worker {
+	unsigned long seed;	// Seed of the random number generator of this thread
+	int node, cpu;	// NUMA node and CPU the thread is pinned to (if numa)
+	vector<double> E_e, E_e_sm;	// Bin contents of the histograms, with underflow and overflow
+	SparseHist fine;	// Fine E_e_sm histogram (if finebin > 0)
+	MultiResHist E_e_mr, E_e_sm_mr;	// Multi-resolution histograms (if nlevels > 0)
+	vector< vector<double> > E_e_sm_res;	// Smeared histograms for each resolution of res_scan
+	EndpointEstimator endpoint;	// Highest smeared energies and tail counts
+	atomic<long> counter;	// Number of events generated so far
+	mutex lock;	// Held while a batch is filled, so that the monitoring loop reads consistent accumulators
+};
+
+// Sampling tables, set up once in bdecay_sim() and shared by all threads
+ChebN cheb;	// Chebyshev surrogate of N()
+CdfFamily cdf;	// Inverse CDF tables
+CorrectionTable corr;	// Product of the spectral corrections over the window (empty = none)
+Isotope shape_isotope;	// Isotope of the shape sampler, with the choice of shape_table
+ShapeSpectrum shape;	// Its spectrum (empty = not used)
+SpectrumModel model;	// Model of the generation, for the expected error and the online fit
+double N_max;	// Von Neumann bound
+struct NodeTables {	// Copy of the sampling tables in the memory of one NUMA node
+	ChebN cheb;
+	CdfFamily cdf;
+	CorrectionTable corr;
+	ShapeSpectrum shape;
+};
+vector<NodeTables*> node_tables;	// One per node (if numa)
+atomic<int> nready(0);	// Workers whose accumulators are set up
+atomic<bool> stop_generation(false);	// Set by the monitoring loop when the stopping criterion is met
+atomic<bool> aborted(false);	// Set by the online fit when the configuration looks wrong
+
 // Functions
 double N(double, double, double);		// Distribution of energy, N(T_e)
 double F(int, double, int);	// Fermi function, F(Z',T_e)
+void generate_events(Worker*, long);
+void run_worker(Worker**, unsigned long, int, int, long);
+void merge_node(vector<Worker*>*, int, int);
+void merge_workers(Worker*, Worker*);
+string engine_name();
+EndpointEstimator merged_endpoint(vector<Worker*>&);
+double sigma_m2(vector<Worker*>&, const vector<double>&);
+void merged_histograms(vector<Worker*>&, vector<double>&, vector<double>&);
+void publish_snapshot(ShmSnapshot&, vector<Worker*>&, long, double);
+void online_fit(vector<Worker*>*);
+void to_rate(TH1D*);
+int bin(double, double);
+
+// Accumulator policy of the generator (see bdecay_generator.h): the histograms of a worker, filled batch by batch
+struct WorkerFill {
+	Worker *w;
+	double width;	// Histogram bin width
+
+	template<class Real> void Fill(const Real *T_e, const Real *T_e_sm, const Real *z, int n) {
+		lock_guard<mutex> lock(w->lock);	// Held while a batch is filled, so that the monitoring loop reads consistent accumulators
+		for (int i=0; i<n; i++) {
+			w->E_e[bin(T_e[i], width)]++;	// Enter true electron kinetic energy in histogram to create beta decay spectrum
+			w->E_e_sm[bin(T_e_sm[i], width)]++;	// Enter smeared electron kinetic energy in histogram to create beta decay spectrum
+			if (finebin > 0) w->fine.Fill(T_e_sm[i]);
+			if (nlevels > 0) {
+				w->E_e_mr.Fill(T_e[i]);
+				w->E_e_sm_mr.Fill(T_e_sm[i]);
+			}
+			for (int k=0; k<nres; k++) w->E_e_sm_res[k][bin(T_e[i] + res_scan[k]*z[i], width)]++;	// Same true energy and normal number, scaled per resolution
+			w->endpoint.Fill(T_e_sm[i]);
+		}
+	}
+	void Progress(long counter) { w->counter = counter; }	// Publish the progress
+};
+GeneratorRegistry<WorkerFill> registry = default_registry<WorkerFill>();	// All the pre-instantiated generators
 
 // Main program
 void bdecay_sim(string filename){
 
 	limit= limit*Q;	// Limit above which we want our spectrum
-
-	// ROOT random number generator
-	TRandom3 *rand = new TRandom3(time(0));	// Generate a random number generator for TRandom3
+	int nth = nthreads>0 ? nthreads : max(1u, thread::hardware_concurrency());
 
 	// ROOT Histograms
 	TH1D *E_e = new TH1D("E_{e}", ";E_{e} [eV];Intensity", ndivisions, limit, Q);	// True kinetic energy histogram for electron
@@ -67,46 +187,503 @@ void bdecay_sim(string filename){
 	// ROOT rootfile (will contain all histograms)
 	TFile *rootfile = new TFile((filename + ".root").c_str(), "recreate");
 
-	cout << "(Generating 1e" << log10(1.*nevents) << " events...)\n";
+	// Base seed, from which the streams of the threads are derived
+	unsigned long base_seed = seed ? seed : (unsigned long)chrono::system_clock::now().time_since_epoch().count() >> 1;
+	cout << "Seed: " << base_seed << endl;
+
 	cout << "Q = " << Q << " eV\n";
 
-	int counter=0;	// Counter for the while loop
-	while (counter < nevents) {
-		// We use Von Neumann acceptance-rejection method, see phys620 course notes (Monte Carlo p. 21)
-		double T_e = rand->Uniform(limit,Q);	// True kinetic energy of the electron. Number between 0 and Q, as there is no energy above Q
+	// Generator policies
+	if (!registry.Has(engine_name())) {
+		cout << "Unknown generator " << engine_name() << ". Available:";
+		for (const string &name : registry.Names()) cout << " " << name;
+		cout << endl;
+		return;
+	}
+	cout << "Generator: " << engine_name() << endl;
+	if (finebin > 0 && engine_name().find(":float") != string::npos) {	// Float energies are spaced by about 2 meV near 18.6 keV
+		float top = Q+10;
+		double spacing = nextafter(top, 2*top) - top;
+		if (finebin < spacing) {
+			cout << "finebin = " << finebin << " eV is below the spacing " << spacing << " eV of float energies near Q: use a double generator or finebin >= " << spacing << endl;
+			return;
+		}
+	}
+
+	if (nres > 0 && engine_name().find(":none:") != string::npos) {	// The extra resolutions scale the normal number of the smearing, which is 0 for a perfect detector
+		cout << "nres = " << nres << " needs the gauss smearing: with " << engine_name() << " the E_e_sm_r<k> histograms would not be smeared" << endl;
+		return;
+	}
+
+	// Chebyshev surrogate of N() over the window, and Von Neumann bound
+	if (engine_name().find(":cheb:") != string::npos) {
+		if (chebyshev <= 0) {
+			cout << "Set chebyshev to the order of the surrogate" << endl;
+			return;
+		}
+		cheb.Init(limit, Q, chebyshev);
+		cout << "Chebyshev surrogate of order " << chebyshev << ", max relative error = " << cheb.maxerr << endl;
+	}
+
+	// Isotope of the generation: the one of the shape sampler, tritium otherwise
+	bool use_shape = engine_name().find(":shape:") != string::npos;
+	if (use_shape && !find_isotope(isotope)) {
+		cout << "Unknown isotope " << isotope << endl;
+		return;
+	}
+	shape_isotope = *find_isotope(use_shape ? isotope : "3H");
+	if (shape_table >= 0) shape_isotope.tabulated = shape_table;
+
+	// Spectral corrections for its daughter, tabulated once: the generation then costs one interpolation per event for all of them
+	CorrectionStack stack;
+	string error;
+	if (!stack.Add(corrections, Q, error, shape_isotope.Z, shape_isotope.A)) {
+		cout << "Corrections " << corrections << ": " << error << endl;
+		return;
+	}
+	corr = CorrectionTable();
+	if (stack.Size() > 0) {
+		corr.Init(stack, limit, Q, corr_nbins);
+		cout << "Corrections:";
+		for (size_t i=0; i<stack.Size(); i++) cout << " " << stack.Term(i).Name();
+		cout << ", tabulated on " << corr_nbins << " intervals, max relative error = " << corr.maxerr << endl;
+	}
+	N_max = h*N(Q/2, m_nu, 1);	// "h" is a factor that can be changed so that the sample is more efficient. See phys620 course notes (Monte Carlo p. 21)
+	double N_window = 0;	// Maximum over the window of N(), or of its surrogate, which the bound must not cut
+	for (int i=0; i<=1000; i++) {
+		double T_e = limit + (Q-limit)*i/1000.;
+		N_window = max(N_window, !cheb.c.empty() ? cheb.Eval(T_e, m_nu*m_nu, 1., Q) : N(T_e, m_nu, 1));
+	}
+	if (N_max < 1.01*N_window) {
+		cout << "h*N(Q/2) is below the maximum of the spectrum over [" << limit << ", " << Q << "] eV: bound raised to 1.01 times that maximum" << endl;
+		N_max = 1.01*N_window;
+	}
+	if (!corr.Empty()) N_max *= corr.vmax;
 
-		double u = rand->Uniform(1);	// Number between 0 and 1
-		if (u <= N(T_e, m_nu, 1.) / (h*N(Q/2, m_nu, 1)))	// "h" is a factor that can be changed so that the sample is more efficient. See phys620 course notes (Monte Carlo p. 21)
-		{
-			E_e->Fill(T_e);		// Enter true electron kinetic energy in histogram to create beta decay spectrum
+	// Spectrum of another isotope, and its Von Neumann bound from the maximum over the window
+	shape = ShapeSpectrum();
+	if (use_shape) {
+		if (fabs(shape_isotope.Q - Q) > 0.01*Q) cout << "Warning: Q = " << Q << " eV, the endpoint of " << isotope << " is " << shape_isotope.Q << " eV" << endl;
+		shape.Init(shape_isotope, limit, Q, shape_nbins);
+		cout << "Isotope " << isotope << (shape_isotope.forbidden ? ", first unique forbidden" : ", allowed");
+		if (shape_isotope.tabulated) cout << ", tabulated on " << shape_nbins << " intervals, max relative error = " << shape.maxerr;
+		else cout << ", exact";
+		cout << endl;
+		N_max = 0;
+		for (int i=0; i<=1000; i++) N_max = max(N_max, shape(limit + (Q-limit)*i/1000., m_nu*m_nu, 1., Q));
+		N_max *= 1.01*(corr.Empty() ? 1. : corr.vmax);
+	}
 
-			double T_e_sm = rand->Gaus(T_e,res);	// Smeared kinetic energy
-			if (Q<=T_e_sm<=limit*Q){
-				E_e_sm->Fill(T_e_sm);	// Enter smeared electron kinetic energy in histogram to create beta decay spectrum
+	// Inverse CDF tables, built once for all masses up to cdf_m2max
+	if (engine_name().find(":cdf:") != string::npos) {
+		if (m_nu*m_nu > cdf_m2max) {	// Sample() would extrapolate the last table
+			cout << "m_nu^2 = " << m_nu*m_nu << " eV^2 is above cdf_m2max = " << cdf_m2max << " eV^2: raise cdf_m2max" << endl;
+			return;
+		}
+		cdf.Init(limit, Q, cdf_m2max, cdf_nm2, cdf_nq, 20*cdf_nq, corr.Empty() ? 0 : &corr);
+	}
+
+	// Model of the generation, for the expected error and the online fit
+	model = SpectrumModel();
+	model.corr = corr;
+	model.shape = shape;
+
+	// Number of events: fixed, or the Poisson number of decays in the window for the exposure activity*livetime
+	long ntotal = nevents;
+	double fraction = 0;	// Fraction of the decays with T_e in [limit, Q], of the spectrum of the generation
+	if (activity > 0) {
+		Isotope full_iso = shape_isotope;	// The tables of the generation only cover the window: the isotope spectrum is tabulated again over [0, Q],
+		full_iso.tabulated = true;	// and the corrections are exact
+		ShapeSpectrum full;
+		if (use_shape) full.Init(full_iso, 0., Q, 65536);
+		auto spectrum = [&](double T_e) { return (full.Empty() ? N_gen<double>(T_e, m_nu*m_nu, 1., Q) : full(T_e, m_nu*m_nu, 1., Q)) * stack.Factor(T_e); };
+		fraction = integral_gen(limit, Q, 200000, spectrum) / integral_gen(0., Q, 2000000, spectrum);
+		TRandom3 exposure(CounterRng(base_seed, 1, 0).key);	// Own stream of the base seed, unrelated to those of the threads
+		ntotal = long(exposure.PoissonD(activity*livetime*fraction));	// Can be above 2^31 for long exposures
+		cout << "Fraction of decays in the window: " << fraction << ", expected " << activity*livetime*fraction << " events\n";
+	}
+	if (ntotal > 0) cout << "(Generating 1e" << log10(1.*ntotal) << " events on " << nth << " threads...)\n";
+	else cout << "(No events to generate)\n";
+
+	// d(log N)/d(m_nu^2) of the smeared spectrum in each E_e_sm bin, for the expected error on m_nu^2
+	vector<double> dlogN(ndivisions+2, 0.);
+	for (int i=1; i<=ndivisions; i++) {
+		typedef Dual<1> D;
+		D f = model.Fold<D>(D(E_e_sm->GetBinCenter(i)), D::Var(m_nu*m_nu, 0), D(1.), D(Q), D(res));
+		if (f.val > 0) dlogN[i] = f.d[0]/f.val;
+	}
+
+	// Placement of the threads: thread t on node t % nnodes, each pinned to its own CPU
+	NumaLayout layout = NumaLayout::Detect();
+	vector<int> node(nth, 0), cpu(nth, -1);
+	int nnodes = 1;
+	if (numa) {
+		layout.Place(nth, node, cpu);
+		nnodes = min(layout.Nodes(), nth);
+		cout << "NUMA: " << layout.Nodes() << " node(s)" << endl;
+		for (int k=0; k<nnodes; k++) {
+			cout << "  node " << k << ": threads";
+			for (int t=k; t<nth; t+=nnodes) cout << " " << t;
+			cout << " on CPUs";
+			for (int t=k; t<nth; t+=nnodes) cout << " " << cpu[t];
+			cout << endl;
+		}
+
+		// Copies of the sampling tables, made by a thread on each node so that the pages are allocated there
+		node_tables.assign(nnodes, (NodeTables*)0);
+		vector<thread> copiers;
+		for (int k=0; k<nnodes; k++) {
+			copiers.push_back(thread([k, &cpu]() {
+				pin_thread(cpu[k]);
+				node_tables[k] = new NodeTables{cheb, cdf, corr, shape};
+			}));
+		}
+		for (int k=0; k<nnodes; k++) copiers[k].join();
+	}
+
+	// One worker per thread, each with its own random number generator and histograms, allocated by the thread itself
+	vector<Worker*> workers(nth, (Worker*)0);
+	vector<thread> threads;
+	nready = 0;
+	for (int t=0; t<nth; t++) threads.push_back(thread(run_worker, &workers[t], CounterRng::Hash(base_seed, t), node[t], cpu[t], ntotal/nth + (t < ntotal%nth)));
+	while (nready < nth) this_thread::sleep_for(chrono::milliseconds(1));
+
+	// Online fit, on its own thread
+	thread fit_thread;
+	if (onlinefit > 0 || stopmode == 3) fit_thread = thread(online_fit, &workers);
+
+	// Live snapshots for external monitors
+	ShmSnapshot shm;
+	if (shm_name != "" && !shm.Create(shm_name, ndivisions, limit, Q, Q, res, limit, corrections, shape.Empty() ? "" : isotope)) cout << "Could not create the shared-memory segment " << shm_name << endl;
+
+	// For execution purposes, acts as a "progress bar". Also prints the telemetry
+	auto start = chrono::steady_clock::now();
+	double last_telemetry = 0, last_snapshot = 0;
+	long counter = 0;
+	int percent = 0;
+	while (counter < ntotal && !stop_generation) {
+		this_thread::sleep_for(chrono::milliseconds(200));
+		counter = 0;
+		for (int t=0; t<nth; t++) counter += workers[t]->counter;
+		while (percent < 100*counter/max(ntotal,1L)) {
+			percent++;
+			cout << "Current progress: ";
+			cout << percent << "%"<< endl;	// Display progress
+			if (!(percent % 10)) {
+				cout << "-----" << endl;	// Output "-----" every 10% events
 			}
-			// For execution purposes, acts as a "progress bar"
-			if (!(++counter % (nevents/100))) {	// Add 1 to counter and take its modulo, if we finished a 10% of the job
-				cout << "Current progress: ";
-				cout << 100.*counter/nevents << "%"<< endl;	// Display progress
-				if (!(counter % (nevents/10))) {
-					cout << "-----" << endl;	// Output "-----" every 10% events
-				}
+		}
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		if (telemetry > 0 && elapsed - last_telemetry >= telemetry) {
+			last_telemetry = elapsed;
+			EndpointEstimator ep = merged_endpoint(workers);
+			double Q_eff = ep.Qeff(), tail = ep.Counts(Q_eff-1, Q_eff);
+			cout << "Telemetry: " << counter << " events, Q_eff = " << Q_eff << " eV, " << tail << " events in the last eV (" << tail/elapsed << " /s)" << endl;
+		}
+		if (shm.IsOpen() && elapsed - last_snapshot >= snapshot) {
+			last_snapshot = elapsed;
+			publish_snapshot(shm, workers, counter, elapsed);
+		}
+
+		// Stopping criterion, from the merged counts of the threads
+		if (stopmode == 1) {
+			double tail = merged_endpoint(workers).Counts(Q-1, Q);
+			if (tail >= stop_tail) {
+				cout << "Stopping: " << tail << " events in the last eV" << endl;
+				stop_generation = true;
 			}
 		}
+		if (stopmode == 2) {
+			double sigma = sigma_m2(workers, dlogN);
+			if (sigma <= stop_sigma) {
+				cout << "Stopping: expected sigma(m_nu^2) = " << sigma << " eV^2" << endl;
+				stop_generation = true;
+			}
+		}
+	}
+	stop_generation = true;
+	for (int t=0; t<nth; t++) threads[t].join();
+	if (fit_thread.joinable()) fit_thread.join();
+	if (aborted) cout << "Generation aborted by the online fit" << endl;
+	counter = 0;
+	for (int t=0; t<nth; t++) counter += workers[t]->counter;
+	if (shm.IsOpen()) {
+		publish_snapshot(shm, workers, counter, chrono::duration<double>(chrono::steady_clock::now() - start).count());	// Final state
+		shm.Finish();
 	}
+
+	EndpointEstimator ep = merged_endpoint(workers);
+	double sigma = sigma_m2(workers, dlogN);	// Before the merge, which adds the counts of the threads into workers[0]
+
+	// Merge the threads: within each node first, on that node, so that only one set of histograms per node crosses to workers[0]
+	vector<thread> mergers;
+	for (int k=0; k<nnodes; k++) mergers.push_back(thread(merge_node, &workers, k, nnodes));
+	for (int k=0; k<nnodes; k++) mergers[k].join();
+	for (int k=1; k<nnodes; k++) merge_workers(workers[0], workers[k]);
+	for (int i=0; i<ndivisions+2; i++) {
+		E_e->SetBinContent(i, workers[0]->E_e[i]);
+		E_e_sm->SetBinContent(i, workers[0]->E_e_sm[i]);
+	}
+	E_e->SetEntries(counter);
+	E_e_sm->SetEntries(counter);
+	to_rate(E_e);
+	to_rate(E_e_sm);
+
 	E_e->Write();	// Save histogram into the rootfile
 	E_e_sm->Write();	// Save histogram into the rootfile
+	for (int k=0; k<nres; k++) {
+		TH1D *E_e_sm_r = new TH1D(Form("E_e_sm_r%d", k), Form("res = %g eV;E_{e} [eV];Intensity", res_scan[k]), ndivisions, limit, Q);	// Smeared with resolution res_scan[k]
+		for (int i=0; i<ndivisions+2; i++) E_e_sm_r->SetBinContent(i, workers[0]->E_e_sm_res[k][i]);
+		E_e_sm_r->SetEntries(counter);
+		to_rate(E_e_sm_r);
+		E_e_sm_r->Write();
+	}
+	TParameter<double>("Q_eff", ep.Qeff()).Write();	// Observed endpoint from the highest smeared energies
+	TParameter<double>("Q", Q).Write();	// Generator endpoint, resolution and lower edge of the true energies, for the fits
+	TParameter<double>("res", res).Write();
+	TParameter<double>("limit", limit).Write();
+	TParameter<Long64_t>("seed", base_seed).Write();	// Base seed, to repeat the run
+	if (corrections != "") TNamed("corrections", corrections.c_str()).Write();	// Spectral corrections of the generation, to fit with the same model
+	if (!shape.Empty()) TNamed("isotope", isotope.c_str()).Write();	// Spectrum of the generation, if not N()
+
+	// Achieved statistics
+	TParameter<double>("nevents", counter).Write();
+	if (aborted) TParameter<int>("aborted", 1).Write();	// Stopped by the online fit
+	TParameter<double>("tail_events", ep.Counts(Q-1, Q)).Write();	// Smeared events in [Q-1, Q]
+	TParameter<double>("sigma_m2", sigma).Write();	// Expected statistical error on m_nu^2 (eV^2)
+	cout << "Generated " << counter << " events, " << ep.Counts(Q-1, Q) << " in the last eV, expected sigma(m_nu^2) = " << sigma << " eV^2" << endl;
+	if (activity > 0) {
+		TParameter<double>("activity", activity).Write();	// Bq
+		TParameter<double>("livetime", livetime).Write();	// s
+		TParameter<double>("fraction", fraction).Write();	// Fraction of the decays in [limit, Q]
+	}
+	if (finebin > 0) {
+		cout << "Sparse histogram: " << workers[0]->fine.Pages() << " pages of " << SparseHist::pagesize << " bins allocated" << endl;
+		TH1D *E_e_sm_fine = workers[0]->fine.Dense("E_e_sm_fine", fine_lo, fine_hi);	// Dense region of interest, for fitting
+		to_rate(E_e_sm_fine);
+		E_e_sm_fine->Write();
+	}
+	for (int l=0; l<nlevels; l++) {
+		TH1D *level = workers[0]->E_e_mr.Get("E_e", l);
+		to_rate(level);
+		level->Write();
+		level = workers[0]->E_e_sm_mr.Get("E_e_sm", l);
+		to_rate(level);
+		level->Write();
+	}
+	for (int t=0; t<nth; t++) delete workers[t];
+	for (size_t k=0; k<node_tables.size(); k++) delete node_tables[k];
+	node_tables.clear();
+}
+
+// Thread of one worker: pins itself (if numa), then allocates and zeroes its accumulators, so that their pages are on its node
+void run_worker(Worker **slot, unsigned long seed, int node, int cpu, long nev)
+{
+	if (numa && !pin_thread(cpu)) cout << "Could not pin a thread to CPU " << cpu << endl;
+	Worker *w = new Worker();
+	w->seed = seed;
+	w->node = node;
+	w->cpu = cpu;
+	w->E_e.assign(ndivisions+2, 0.);
+	w->E_e_sm.assign(ndivisions+2, 0.);
+	if (finebin > 0) w->fine = SparseHist(0., Q+10, finebin);
+	w->E_e_mr = MultiResHist(level_hi);
+	w->E_e_sm_mr = MultiResHist(level_hi);
+	for (int l=0; l<nlevels; l++) {
+		w->E_e_mr.AddLevel(level_lo[l], level_nbins[l]);
+		w->E_e_sm_mr.AddLevel(level_lo[l], level_nbins[l]);
+	}
+	w->E_e_sm_res.assign(nres, vector<double>(ndivisions+2, 0.));
+	w->endpoint = EndpointEstimator(topk, Q-5, Q+5, 1000);
+	w->counter = 0;
+	*slot = w;
+	nready++;
+	generate_events(w, nev);
+}
+
+// Add the workers k+nnodes, k+2*nnodes, ... of node k into workers[k], on a thread of that node
+void merge_node(vector<Worker*> *workers, int k, int nnodes)
+{
+	if (numa) pin_thread((*workers)[k]->cpu);
+	for (size_t t=k+nnodes; t<workers->size(); t+=nnodes) merge_workers((*workers)[k], (*workers)[t]);
+}
+
+// Add the histograms of the worker from into the worker into
+void merge_workers(Worker *into, Worker *from)
+{
+	for (int i=0; i<ndivisions+2; i++) {
+		into->E_e[i] += from->E_e[i];
+		into->E_e_sm[i] += from->E_e_sm[i];
+	}
+	for (int k=0; k<nres; k++) {
+		for (int i=0; i<ndivisions+2; i++) into->E_e_sm_res[k][i] += from->E_e_sm_res[k][i];
+	}
+	if (finebin > 0) into->fine.Merge(from->fine);
+	if (nlevels > 0) {
+		into->E_e_mr.Merge(from->E_e_mr);
+		into->E_e_sm_mr.Merge(from->E_e_sm_mr);
+	}
+}
+
+// Generate nev events in one thread, with the generator selected by engine
+void generate_events(Worker *w, long nev)
+{
+	const ChebN *ch = numa ? &node_tables[w->node]->cheb : &cheb;	// Tables of the node of the thread
+	const CdfFamily *cd = numa ? &node_tables[w->node]->cdf : &cdf;
+	const CorrectionTable *co = corr.Empty() ? 0 : numa ? &node_tables[w->node]->corr : &corr;
+	const ShapeSpectrum *sh = numa ? &node_tables[w->node]->shape : &shape;
+	GenConfig c = {limit, Q, m_nu*m_nu, res, N_max, ch, cd, co, sh, w->seed, &stop_generation};
+	WorkerFill acc = {w, (Q-limit)/ndivisions};
+	GeneratorBase *g = registry.Create(engine_name(), c, acc);
+	g->Run(nev);
+	delete g;
+}
+
+// Name of the generator: engine, or the combination given by sampler and chebyshev
+string engine_name()
+{
+	if (engine != "") return engine;
+	return string("trandom3:") + (sampler == 2 ? "shape" : sampler == 1 ? "cdf" : chebyshev > 0 ? "cheb" : "exact") + ":gauss:double";
+}
+
+// Endpoint estimators of all threads, merged
+EndpointEstimator merged_endpoint(vector<Worker*> &workers)
+{
+	EndpointEstimator ep;
+	for (size_t t=0; t<workers.size(); t++) {
+		lock_guard<mutex> lock(workers[t]->lock);
+		if (t == 0) ep = workers[t]->endpoint;
+		else ep.Merge(workers[t]->endpoint);
+	}
+	return ep;
+}
+
+// Expected statistical error on m_nu^2 with C free, from the Fisher information of the merged E_e_sm counts n_i:
+// 1/sigma^2 = sum n_i g_i^2 - (sum n_i g_i)^2/sum n_i, with g_i = d(log N)/d(m_nu^2) in bin i
+double sigma_m2(vector<Worker*> &workers, const vector<double> &dlogN)
+{
+	double sn = 0, sng = 0, sngg = 0;
+	for (size_t t=0; t<workers.size(); t++) {
+		lock_guard<mutex> lock(workers[t]->lock);
+		for (int i=1; i<=ndivisions; i++) {
+			double n = workers[t]->E_e_sm[i];
+			sn += n;
+			sng += n*dlogN[i];
+			sngg += n*dlogN[i]*dlogN[i];
+		}
+	}
+	double info = sngg - (sn > 0 ? sng*sng/sn : 0.);
+	return info > 0 ? 1./sqrt(info) : 1e30;
+}
+
+// Sum of the E_e and E_e_sm counts of the threads. Each worker is only locked while its histograms are added, as in merged_endpoint()
+void merged_histograms(vector<Worker*> &workers, vector<double> &E_e, vector<double> &E_e_sm)
+{
+	E_e.assign(ndivisions+2, 0.);
+	E_e_sm.assign(ndivisions+2, 0.);
+	for (size_t t=0; t<workers.size(); t++) {
+		lock_guard<mutex> lock(workers[t]->lock);
+		for (int i=0; i<ndivisions+2; i++) {
+			E_e[i] += workers[t]->E_e[i];
+			E_e_sm[i] += workers[t]->E_e_sm[i];
+		}
+	}
+}
+
+// Publish the merged counts of the threads
+void publish_snapshot(ShmSnapshot &shm, vector<Worker*> &workers, long counter, double elapsed)
+{
+	static vector<double> E_e, E_e_sm;
+	merged_histograms(workers, E_e, E_e_sm);
+	EndpointEstimator ep = merged_endpoint(workers);
+	ShmFrame frame;
+	frame.nevents = counter;
+	frame.elapsed = elapsed;
+	frame.Q_eff = ep.Qeff();
+	frame.tail = ep.Counts(frame.Q_eff-1, frame.Q_eff);
+	shm.Publish(frame, &E_e[0], &E_e_sm[0]);
+}
+
+// Refit m_nu^2 and C in the merged E_e_sm counts until the generation stops, each fit starting from the previous one.
+// Stops the generation in stopmode 3, and aborts it when the fit disagrees with the generated spectrum
+void online_fit(vector<Worker*> *workers)
+{
+	const double width = (Q-limit)/ndivisions;	// Histogram bin width
+	const double period = onlinefit > 0 ? onlinefit : 1.;
+	vector<double> E_e, E_e_sm, x, y, err;
+	BetaFitter fitter;
+	fitter.SetFolding(res);	// Same model as the generation
+	model.Apply(fitter);
+	fitter.SetParameter(BetaFitter::M2, m_nu*m_nu);
+	fitter.SetParameter(BetaFitter::Q_E, Q, true);
+	bool started = false;
+	auto start = chrono::steady_clock::now();
+	while (!stop_generation) {
+		for (double t=0; t<period && !stop_generation; t+=0.05) this_thread::sleep_for(chrono::milliseconds(50));
+		if (stop_generation) break;
+
+		merged_histograms(*workers, E_e, E_e_sm);
+		x.clear();
+		y.clear();
+		err.clear();
+		double sy = 0;
+		for (int i=1; i<=ndivisions; i++) {
+			double xi = limit + (i-0.5)*width;
+			if (xi < fitmin || xi > fitmax) continue;
+			x.push_back(xi);
+			y.push_back(E_e_sm[i]);
+			err.push_back(sqrt(E_e_sm[i]));
+			sy += E_e_sm[i];
+		}
+		if (sy <= 0) continue;
+		fitter.SetData(x.size(), &x[0], &y[0], &err[0]);
+		if (!started) fitter.SetParameter(BetaFitter::C, StartC(model, x, y, m_nu*m_nu, Q, res));	// Later fits start from the previous one
+		started = true;
+		TStopwatch sw;
+		sw.Start();
+		int status = fitter.Fit();
+		double m2 = fitter.par[BetaFitter::M2], sigma = fitter.err[BetaFitter::M2], chi2ndf = fitter.ndf > 0 ? fitter.chi2/fitter.ndf : 0.;
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "Online fit (" << elapsed << " s, " << sy << " events in range): m_nu^2 = " << m2 << " +- " << sigma << " eV^2, ChiSq/ndf = " << chi2ndf << ", " << fitter.niter << " iterations in " << 1e3*sw.RealTime() << " ms" << endl;
+		if (status != 0) continue;
+
+		if ((abort_pull > 0 && fabs(m2 - m_nu*m_nu) > abort_pull*sigma) || (abort_chi2 > 0 && chi2ndf > abort_chi2)) {
+			cout << "Aborting: the online fit does not reproduce the generated spectrum (check h, the sampler and the surrogate)" << endl;
+			aborted = true;
+			stop_generation = true;
+		}
+		if (stopmode == 3 && sigma <= stop_sigma) {
+			cout << "Stopping: online fit sigma(m_nu^2) = " << sigma << " eV^2" << endl;
+			stop_generation = true;
+		}
+	}
+}
+
+// Convert a histogram of counts to counts per second of live time (if the generation is driven by the activity)
+void to_rate(TH1D *h)
+{
+	if (activity <= 0) return;
+	h->Sumw2();	// Keep the Poisson errors of the counts
+	h->Scale(1./livetime);
+	h->GetYaxis()->SetTitle("Rate [counts/s]");
+}
+
+// Histogram bin of the energy x, as in TH1 (0 = underflow, ndivisions+1 = overflow)
+int bin(double x, double width)
+{
+	if (x < limit) return 0;
+	if (x >= Q) return ndivisions+1;
+	return 1 + min(int((x-limit)/width), ndivisions-1);
 }
 
 // Energy distribution for beta decay
 double N(double T_e, double m_nu, double C)
 {
-	return C*sqrt( pow(T_e,2) + 2*T_e*m_e ) * (T_e + m_e) * (Q-T_e) * sqrt( pow(Q-T_e,2) - pow(m_nu,2) ) * F(Z_2,T_e, charge); // Supposing C=1, taken from http://www2.warwick.ac.uk/fac/sci/physics/research/epp/exp/detrd/amber/betaspectrum/ 
+	return N_gen<double>(T_e, m_nu*m_nu, C, Q);	// Supposing C=1, see bdecay_spectrum.h
 }
 
 // Fermi function
 double F(int Z_2, double T_e, int charge)
 {
-	double eta = (T_e + m_e) * charge * alpha * Z_1 / sqrt(2*T_e*m_e);	// Taken from https://en.wikipedia.org/wiki/Beta_decay#Fermi_function
-	return 2. * Pi * eta / (1 - exp(-2*Pi*eta)); // Taken from https://en.wikipedia.org/wiki/Beta_decay#Fermi_function
+	return F_gen<double>(Z_2, T_e, charge);	// See bdecay_spectrum.h
 }
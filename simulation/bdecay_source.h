@@ -0,0 +1,147 @@
+//********************************************************************
+// Beta decay event source for other programs
+//
+// EventSource fills caller-provided arrays with batches of events: true
+// and smeared kinetic energies, and optionally weights, decay times and
+// detector pixels. It does not need ROOT. Everything it needs (sampling
+// tables, random streams) is set up in the constructor, so Fill() never
+// allocates and writes straight into the caller's arrays.
+//
+// The random numbers come from counter-based streams (bdecay_rng.h): the
+// whole state of a source is a few counters (SourceState), so a run can
+// be saved and resumed exactly. Energies, times and pixels each have
+// their own stream, and the time and pixel of event k are drawn from the
+// k-th numbers of theirs, so they do not depend on which quantities were
+// requested in earlier batches. Fill() locks the instance, so one source
+// can be shared by threads; for throughput give each thread its own
+// source with its own seed.
+//
+// Like the other headers, this file uses Z_1, Z_2, charge, m_e, alpha and
+// Pi, which the including program defines before including it, e.g.
+//	const int Z_1 = 1, Z_2 = 2, charge = -1;
+//	const double Pi = 3.14159265, alpha = 1./137, m_e = 0.510998910e6;
+//	#include "bdecay_source.h"
+//	SourceConfig cfg;	// Tritium, 1 eV resolution, inverse CDF sampling
+//	EventSource source(cfg);
+//	source.Fill(buffers, n);
+//********************************************************************
+
+#ifndef BDECAY_SOURCE_H
+#define BDECAY_SOURCE_H
+
+#include<cmath>
+#include<mutex>
+#include<stdint.h>
+
+#include "bdecay_spectrum.h"
+#include "bdecay_sampler.h"
+#include "bdecay_rng.h"
+
+struct SourceConfig {
+	double lo, Q_0;	// Window of the true kinetic energy (in eV)
+	double m_nu2;	// Neutrino mass squared (in eV^2)
+	double res;	// Gaussian resolution (in eV)
+	int sampler;	// 0 = inverse CDF tables, 1 = Von Neumann with the Chebyshev surrogate, 2 = flat energies with weights N(T_e)/<N>
+	double cdf_m2max;	// Inverse CDF tables (sampler 0), see bdecay_sampler.h. Raised to m_nu2 if below
+	int cdf_nm2, cdf_nq;
+	int chebyshev;	// Order of the surrogate (sampler 1)
+	double activity;	// Decays per second in the window, for the decay times
+	int npixels;	// Number of detector pixels, drawn uniformly
+	uint64_t seed;
+
+	SourceConfig() : lo(18590-25), Q_0(18590), m_nu2(0.04), res(1), sampler(0), cdf_m2max(1), cdf_nm2(21), cdf_nq(4096), chebyshev(6), activity(1), npixels(1), seed(4357) {}
+};
+
+// Caller-owned arrays of at least n elements. Null arrays are not filled
+struct EventBuffers {
+	double *T_e;	// True kinetic energies (in eV)
+	double *T_e_sm;	// Smeared kinetic energies (in eV)
+	double *weight;	// Event weights (1 unless sampler = 2)
+	double *time;	// Decay times (in s), a Poisson process at the activity
+	int *pixel;	// Pixels, 0 to npixels-1
+
+	EventBuffers() : T_e(0), T_e_sm(0), weight(0), time(0), pixel(0) {}
+};
+
+// Everything needed to resume a source where it stopped
+struct SourceState {
+	uint64_t ctr;	// Position in the energy stream
+	double time;	// Time of the last decay
+	long nevents;	// Events delivered, the position in the time and pixel streams
+};
+
+class EventSource {
+public:
+	explicit EventSource(const SourceConfig &c_) : c(c_), energy(c_.seed, 1, 0), times(c_.seed, 2, 0), pixels(c_.seed, 2, 1) {
+		state.ctr = 0;
+		state.time = 0;
+		state.nevents = 0;
+		if (c.sampler == 0) cdf.Init(c.lo, c.Q_0, std::max(c.cdf_m2max, c.m_nu2), c.cdf_nm2, c.cdf_nq, 20*c.cdf_nq);	// The grid must reach m_nu2: Sample() does not extrapolate
+		if (c.sampler == 1) {
+			cheb.Init(c.lo, c.Q_0, c.chebyshev);
+			N_max = 0;	// Maximum of N() in the window, with a margin
+			for (int i=0; i<=1000; i++) N_max = std::max(N_max, N_gen<double>(c.lo + (c.Q_0-c.lo)*i/1000., c.m_nu2, 1., c.Q_0));
+			N_max *= 1.01;
+		}
+		if (c.sampler == 2) N_mean = N_integral(c.lo, c.Q_0, c.m_nu2, c.Q_0, 20000)/(c.Q_0-c.lo);
+	}
+
+	// Fill n events into the buffers. Returns n
+	int Fill(const EventBuffers &b, int n) {
+		std::lock_guard<std::mutex> lock(mutex);
+		uint64_t ctr = state.ctr;
+		for (int i=0; i<n; i++) {
+			double T, w = 1;
+			if (c.sampler == 0) T = cdf.Sample(energy.Uniform(ctr++), c.m_nu2);
+			else if (c.sampler == 1) {
+				do {
+					T = c.lo + (c.Q_0-c.lo)*energy.Uniform(ctr++);
+				} while (energy.Uniform(ctr++)*N_max > cheb.Eval(T, c.m_nu2, 1., c.Q_0));	// Von Neumann
+			}
+			else {
+				T = c.lo + (c.Q_0-c.lo)*energy.Uniform(ctr++);
+				w = N_gen<double>(T, c.m_nu2, 1., c.Q_0)/N_mean;
+			}
+			double r = sqrt(-2*log(energy.Uniform(ctr++))), phi = 2*acos(-1.)*energy.Uniform(ctr++);	// Box-Muller, one normal number per event so that the state is only ctr
+			if (b.T_e) b.T_e[i] = T;
+			if (b.T_e_sm) b.T_e_sm[i] = T + c.res*r*cos(phi);
+			if (b.weight) b.weight[i] = w;
+		}
+		state.ctr = ctr;
+
+		// Times and pixels come from their own streams at the event number, so they do not change the energies or each other.
+		// The time advances with every event, so later times do not depend on whether earlier ones were requested
+		uint64_t k = state.nevents;
+		for (int i=0; i<n; i++) {
+			state.time += -log(times.Uniform(k+i))/c.activity;
+			if (b.time) b.time[i] = state.time;
+		}
+		if (b.pixel) {
+			for (int i=0; i<n; i++) b.pixel[i] = std::min(int(pixels.Uniform(k+i)*c.npixels), c.npixels-1);
+		}
+		state.nevents += n;
+		return n;
+	}
+
+	SourceState Save() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return state;
+	}
+	void Restore(const SourceState &s) {
+		std::lock_guard<std::mutex> lock(mutex);
+		state = s;
+	}
+	long Generated() const { return Save().nevents; }
+	const SourceConfig& Config() const { return c; }
+
+private:
+	SourceConfig c;
+	CounterRng energy, times, pixels;	// Streams of the energies, the decay times and the pixels
+	SourceState state;
+	CdfFamily cdf;
+	ChebN cheb;
+	double N_max, N_mean;
+	mutable std::mutex mutex;
+};
+
+#endif
@@ -0,0 +1,180 @@
+//********************************************************************
+// Beta decay spectrum kernels, generic over the scalar type
+//
+// N_gen(), F_gen() and Nfold_gen() are written once as templates. With
+// T = double they are the plain kernels used by the generator and the fits
+// (the double wrappers N() and F() in each macro call them). With
+// T = Dual<n> (see bdecay_dual.h) they return the exact gradient with
+// respect to m_nu^2, C, Q and res in the same pass.
+//
+// ChebN is a Chebyshev expansion of the smooth part of N() over a narrow
+// window, for the generator hot loop.
+//
+// Include this file after the parameter block of the macro: it uses
+// Z_1, Z_2, charge, m_e, alpha and Pi from there.
+//********************************************************************
+
+#ifndef BDECAY_SPECTRUM_H
+#define BDECAY_SPECTRUM_H
+
+#include<cmath>
+#include<vector>
+
+#include "bdecay_dual.h"
+
+using std::sqrt;
+using std::exp;
+
+const int nfold = 81;	// Number of points (odd) of the Simpson rule used to fold the spectrum with the resolution
+const double foldsigma = 5;	// Folding range, in units of res
+
+// Fermi function
+template<typename T>
+T F_gen(int Z, T T_e, int charge)
+{
+	T eta = (T_e + m_e) * charge * alpha * Z_1 / sqrt(2.*T_e*m_e);	// Taken from https://en.wikipedia.org/wiki/Beta_decay#Fermi_function
+	return 2. * Pi * eta / (1. - exp(-2.*Pi*eta)); // Taken from https://en.wikipedia.org/wiki/Beta_decay#Fermi_function
+}
+
+// Energy distribution for beta decay, as a function of the squared neutrino mass and of the endpoint
+template<typename T>
+T N_gen(T T_e, T m_nu2, T C, T Q_0)
+{
+	T E_nu = Q_0 - T_e;	// Neutrino total energy
+	T p_nu2 = E_nu*E_nu - m_nu2;	// Squared neutrino momentum
+	if (value(T_e) <= 0 || value(E_nu) <= 0 || value(p_nu2) <= 0) return T(0.);	// Outside of the kinematically allowed region
+	return C*sqrt( T_e*T_e + 2.*T_e*m_e ) * (T_e + m_e) * E_nu * sqrt(p_nu2) * F_gen(Z_2, T_e, charge); // Taken from http://www2.warwick.ac.uk/fac/sci/physics/research/epp/exp/detrd/amber/betaspectrum/
+}
+
+// Standard normal nodes and weights of the folding rule, computed once
+struct FoldNodes {
+	std::vector<double> z;	// Nodes (in units of res)
+	std::vector<double> w;	// Weights, normalized to 1
+
+	FoldNodes() : z(nfold), w(nfold) {
+		double dz = 2.*foldsigma/(nfold-1), sum = 0;
+		for (int k=0; k<nfold; k++) {
+			z[k] = -foldsigma + k*dz;
+			w[k] = (k==0 || k==nfold-1 ? 1. : (k%2 ? 4. : 2.)) * exp(-0.5*z[k]*z[k]);	// Simpson rule times the gaussian
+			sum += w[k];
+		}
+		for (int k=0; k<nfold; k++) w[k] /= sum;	// So that a constant spectrum is folded exactly
+	}
+};
+
+inline const FoldNodes& fold_nodes()
+{
+	static const FoldNodes nodes;
+	return nodes;
+}
+
+// No spectral correction (see bdecay_corrections.h for the tabulated ones)
+struct NoCorrection {
+	double operator()(double) const { return 1.; }
+};
+
+// Any spectrum model(T_e) folded with a gaussian detector resolution res
+template<typename T, typename Model>
+T fold_gen(T E, T res, const Model &model)
+{
+	const FoldNodes &f = fold_nodes();
+	T sum(0.);
+	for (int k=0; k<nfold; k++) {
+		sum += f.w[k] * model(E - res*f.z[k]);
+	}
+	return sum;
+}
+
+// Energy distribution folded with a gaussian detector resolution res, i.e. the expected smeared spectrum.
+// corr(T_e) multiplies N() before the folding
+template<typename T, typename Corr=NoCorrection>
+T Nfold_gen(T E, T m_nu2, T C, T Q_0, T res, const Corr &corr=Corr())
+{
+	return fold_gen<T>(E, res, [&](const T &T_e) { return N_gen<T>(T_e, m_nu2, C, Q_0) * corr(value(T_e)); });
+}
+
+// Value of N() and its gradient with respect to (m_nu^2, C, Q) in a single pass
+inline double N_grad(double T_e, double m_nu2, double C, double Q_0, double *grad)
+{
+	typedef Dual<3> D;
+	D n = N_gen<D>(D(T_e), D::Var(m_nu2,0), D::Var(C,1), D::Var(Q_0,2));
+	for (int i=0; i<3; i++) grad[i] = n.d[i];
+	return n.val;
+}
+
+// Value of the folded spectrum and its gradient with respect to (m_nu^2, C, Q, res) in a single pass
+inline double Nfold_grad(double E, double m_nu2, double C, double Q_0, double res, double *grad)
+{
+	typedef Dual<4> D;
+	D n = Nfold_gen<D>(D(E), D::Var(m_nu2,0), D::Var(C,1), D::Var(Q_0,2), D::Var(res,3));
+	for (int i=0; i<4; i++) grad[i] = n.d[i];
+	return n.val;
+}
+
+// Integral of any spectrum model(T_e) over [a, b], Simpson rule on n intervals (n even)
+template<typename Model>
+double integral_gen(double a, double b, int n, const Model &model)
+{
+	double step = (b-a)/n, sum = model(a) + model(b);
+	for (int i=1; i<n; i++) sum += (i%2 ? 4. : 2.) * model(a + i*step);
+	return sum*step/3.;
+}
+
+// Integral of N() (with C=1) over [a, b], Simpson rule on n intervals (n even)
+inline double N_integral(double a, double b, double m_nu2, double Q_0, int n)
+{
+	return integral_gen(a, b, n, [&](double T_e) { return N_gen<double>(T_e, m_nu2, 1., Q_0); });
+}
+
+// Chebyshev surrogate of N() on a window [lo, hi]. The smooth part p_e E_e F(T_e), which does not depend on
+// m_nu or Q, is expanded in Chebyshev polynomials; the endpoint phase space factor is evaluated exactly
+struct ChebN {
+	double lo, hi;	// Window
+	std::vector<double> c;	// Chebyshev coefficients
+	double maxerr;	// Maximum relative error of the smooth part, measured on a fine grid
+
+	// Smooth part of N(), exact
+	static double SmoothExact(double T_e) { return sqrt( T_e*T_e + 2*T_e*m_e ) * (T_e + m_e) * F_gen<double>(Z_2, T_e, charge); }
+
+	// Coefficients from the values at the order+1 Chebyshev nodes
+	void Init(double lo_, double hi_, int order) {
+		lo = lo_;
+		hi = hi_;
+		int n = order+1;
+		const double pi = acos(-1.);	// Full precision, the nodes must be exact
+		std::vector<double> f(n);
+		for (int j=0; j<n; j++) f[j] = SmoothExact(0.5*(hi+lo) + 0.5*(hi-lo)*cos(pi*(j+0.5)/n));
+		c.assign(n, 0.);
+		for (int k=0; k<n; k++) {
+			for (int j=0; j<n; j++) c[k] += f[j]*cos(pi*k*(j+0.5)/n);
+			c[k] *= 2./n;
+		}
+		c[0] *= 0.5;
+		maxerr = 0;
+		for (int i=0; i<=1000; i++) {
+			double T_e = lo + (hi-lo)*i/1000.;
+			maxerr = std::max(maxerr, fabs(Smooth(T_e)/SmoothExact(T_e) - 1));
+		}
+	}
+
+	// Clenshaw recurrence: one fma per coefficient
+	double Smooth(double T_e) const {
+		double x = (2*T_e - lo - hi)/(hi - lo), b1 = 0, b2 = 0;
+		for (int k=c.size()-1; k>0; k--) {
+			double b = fma(2*x, b1, c[k] - b2);
+			b2 = b1;
+			b1 = b;
+		}
+		return fma(x, b1, c[0] - b2);
+	}
+
+	// N() with the surrogate smooth part
+	double Eval(double T_e, double m_nu2, double C, double Q_0) const {
+		double E_nu = Q_0 - T_e;
+		double p_nu2 = E_nu*E_nu - m_nu2;
+		if (E_nu <= 0 || p_nu2 <= 0) return 0.;
+		return C * Smooth(T_e) * E_nu * sqrt(p_nu2);
+	}
+};
+
+#endif
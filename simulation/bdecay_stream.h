@@ -0,0 +1,213 @@
+//********************************************************************
+// Lazy streams of event batches (C++20)
+//
+// beta_source(cfg) is a coroutine that fills a batch from an EventSource
+// (bdecay_source.h) each time the consumer asks for the next one:
+//	for (Batch &b : beta_source(cfg, 4096) | window(Q-20, Q) | take(1e6))
+//		for (int i=0; i<b.n; i++) ... b.T_e_sm[i] ...
+// Adaptors are coroutines too and compose with |:
+//   window(lo, hi)	keep the events with smeared energy in [lo, hi]
+//   smear(res, seed)	smear the true energies again with resolution res
+//   take(nevents)	stop after nevents events
+// A BatchStream is also a std::ranges::input_range of batches, so the
+// standard views (e.g. std::views::take(10)) apply to it.
+//
+// Nothing is allocated per batch: the source owns one set of buffers that
+// every batch views, the adaptors work in place, and the coroutine frames
+// come from a per-thread pool of blocks reused from one stream to the
+// next.
+//
+// Include this file after the constants of the program, as
+// bdecay_source.h. Needs C++20; it is empty otherwise.
+//********************************************************************
+
+#ifndef BDECAY_STREAM_H
+#define BDECAY_STREAM_H
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include<coroutine>
+#include<cstddef>
+#include<iterator>
+#include<new>
+#include<ranges>
+#include<utility>
+#include<vector>
+
+#include "bdecay_source.h"
+
+// A batch of events, viewing buffers owned by the source
+struct Batch {
+	double *T_e;	// True kinetic energies
+	double *T_e_sm;	// Smeared kinetic energies
+	double *weight;	// Weights
+	int n;	// Number of events
+
+	// Keep only the events i for which keep(i) is true, in place
+	template<class F> void Compact(F keep) {
+		int m = 0;
+		for (int i=0; i<n; i++) {
+			if (!keep(i)) continue;
+			T_e[m] = T_e[i];
+			T_e_sm[m] = T_e_sm[i];
+			weight[m] = weight[i];
+			m++;
+		}
+		n = m;
+	}
+};
+
+// Per-thread pool of coroutine frames: blocks are kept in free lists by size (in steps of 64 bytes) instead of being freed.
+// Frames larger than the biggest list (their size depends on the compiler) are allocated and freed as usual
+class FramePool {
+public:
+	static void* Allocate(std::size_t size) {
+		std::size_t k = (size + 63)/64;
+		if (k >= nlists) return ::operator new(size);
+		std::vector<void*> &free = Lists()[k];
+		if (free.empty()) return ::operator new(k*64);
+		void *p = free.back();
+		free.pop_back();
+		return p;
+	}
+	static void Release(void *p, std::size_t size) {
+		std::size_t k = (size + 63)/64;
+		if (k >= nlists) ::operator delete(p);
+		else Lists()[k].push_back(p);
+	}
+
+private:
+	static const std::size_t nlists = 64;	// Pooled sizes: up to (nlists-1)*64 bytes
+
+	struct Holder {
+		std::vector< std::vector<void*> > lists;
+		Holder() : lists(nlists) {}
+		~Holder() { for (auto &l : lists) for (void *p : l) ::operator delete(p); }
+	};
+	static std::vector< std::vector<void*> >& Lists() {
+		thread_local Holder h;
+		return h.lists;
+	}
+	static_assert(sizeof(void*) <= 64, "");
+};
+
+// Coroutine producing batches. Move-only; iterating it resumes the coroutine for each batch
+class BatchStream {
+public:
+	struct promise_type {
+		Batch *current = 0;
+
+		BatchStream get_return_object() { return BatchStream(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }	// Lazy: nothing happens until the first batch is asked for
+		std::suspend_always final_suspend() noexcept { return {}; }
+		std::suspend_always yield_value(Batch &b) noexcept {
+			current = &b;
+			return {};
+		}
+		void return_void() {}
+		void unhandled_exception() { throw; }
+
+		static void* operator new(std::size_t size) { return FramePool::Allocate(size); }
+		static void operator delete(void *p, std::size_t size) { FramePool::Release(p, size); }
+	};
+
+	class iterator {
+	public:
+		typedef std::ptrdiff_t difference_type;
+		typedef Batch value_type;
+
+		iterator() : h(0) {}
+		explicit iterator(std::coroutine_handle<promise_type> h_) : h(h_) {}
+		Batch& operator*() const { return *h.promise().current; }
+		iterator& operator++() {
+			h.resume();
+			return *this;
+		}
+		void operator++(int) { ++*this; }
+		bool operator==(std::default_sentinel_t) const { return !h || h.done(); }
+
+	private:
+		std::coroutine_handle<promise_type> h;
+	};
+
+	BatchStream(BatchStream &&o) noexcept : h(std::exchange(o.h, {})) {}
+	BatchStream& operator=(BatchStream &&o) noexcept {
+		if (this != &o) {
+			if (h) h.destroy();
+			h = std::exchange(o.h, {});
+		}
+		return *this;
+	}
+	~BatchStream() { if (h) h.destroy(); }
+
+	iterator begin() {
+		h.resume();	// First batch
+		return iterator(h);
+	}
+	std::default_sentinel_t end() const { return {}; }
+
+private:
+	explicit BatchStream(std::coroutine_handle<promise_type> h_) : h(h_) {}
+	std::coroutine_handle<promise_type> h;
+};
+
+// Batches of batchsize events from a source with the configuration cfg, without end (use take)
+inline BatchStream beta_source(SourceConfig cfg, int batchsize=4096)
+{
+	EventSource source(cfg);
+	std::vector<double> buffer(3*batchsize);	// Allocated once, viewed by every batch
+	EventBuffers b;
+	b.T_e = &buffer[0];
+	b.T_e_sm = &buffer[batchsize];
+	b.weight = &buffer[2*batchsize];
+	Batch batch;
+	while (true) {
+		batch.n = source.Fill(b, batchsize);
+		batch.T_e = b.T_e;
+		batch.T_e_sm = b.T_e_sm;
+		batch.weight = b.weight;
+		co_yield batch;
+	}
+}
+
+////////////////// Adaptors ///////////////////////
+struct window { double lo, hi; };
+struct smear { double res; uint64_t seed; };
+struct take { double nevents; };
+
+inline BatchStream operator|(BatchStream in, window w)
+{
+	for (Batch &b : in) {
+		b.Compact([&](int i) { return b.T_e_sm[i] >= w.lo && b.T_e_sm[i] <= w.hi; });
+		if (b.n > 0) co_yield b;
+	}
+}
+
+inline BatchStream operator|(BatchStream in, smear s)
+{
+	CounterRng stream(s.seed, 3, 0);
+	uint64_t ctr = 0;
+	for (Batch &b : in) {
+		for (int i=0; i<b.n; i++) {
+			double r = sqrt(-2*log(stream.Uniform(ctr++))), phi = 2*acos(-1.)*stream.Uniform(ctr++);
+			b.T_e_sm[i] = b.T_e[i] + s.res*r*cos(phi);
+		}
+		co_yield b;
+	}
+}
+
+inline BatchStream operator|(BatchStream in, take t)
+{
+	long left = long(t.nevents);
+	if (left <= 0) co_return;
+	for (Batch &b : in) {
+		if (b.n > left) b.n = left;	// Last, partial batch
+		left -= b.n;
+		co_yield b;
+		if (left <= 0) co_return;
+	}
+}
+
+#endif
+
+#endif
@@ -0,0 +1,242 @@
+//********************************************************************
+// Systematic uncertainties of the smeared beta decay spectrum
+//
+// Instead of rerunning bdecay_sim for every variation of the detector and
+// spectrum model, the expected E_e_sm spectrum is computed once on a fine
+// true-energy grid and folded into the E_e_sm bins for each variation.
+// Variations are drawn from the priors below and computed in parallel,
+// then combined into the bin-to-bin covariance matrix.
+//
+// To run, do <root -l 'bdecay_syst.cpp("filename")'>
+// Output (in filename.root):
+//   E_e_sm_nom	Nominal expected spectrum (same binning as bdecay_sim)
+//   V_syst	Fractional covariance matrix, V_ij/(mu_i mu_j)
+//   syst_err	Fractional systematic error of each bin, sqrt(V_ii)/mu_i
+//********************************************************************
+
+// C++ libs
+#include <iostream>
+#include<stdlib.h>	//rand, srand
+#include<cmath>
+#include<vector>
+#include<thread>
+
+// ROOT libs
+#include<TH1D.h>
+#include<TH2D.h>
+#include<TFile.h>
+#include<TMath.h>
+#include<TRandom3.h>
+
+using namespace std;
+
+////////////////// Parameters ///////////////////////
+// Initial nucleus
+const int Z_1 = 1;	// Atomic number of initial nucleus (3H)
+const double m_1 = 3.0160492;	// Isotope mass (in atomic mass units)
+
+// Final nucleus
+const int Z_2 = 2;	// Atomic number of final nucleus (3He)
+const double m_2 = 3.0160293;	// Isotope mass (in atomic mass units)
+
+// Other parameters
+const int charge = -1;
+const double Q = 18590; // Katrin Q Value (in eV)
+const double res = 1;	// Resolution of detector (in eV)
+double limit=(Q-25)/Q;	// Number between 0 and 1. Fraction of Q over which we necessitate the energy to be
+const int ndivisions = 100;	// Number of divisions in energy histograms
+const int nsub = 20;	// Number of true energy grid points per histogram bin
+const int nvariations = 500;	// Number of systematic variations to draw
+const int nthreads = 0;	// Number of threads (0 = number of cores)
+const bool shapeonly = true;	// Normalize every variation to the nominal integral (C is free in the fit)
+
+// Final-state distribution of the daughter molecule: excitation energy (in eV) and probability of each line
+const int nfsd = 1;
+const double fsd_E[nfsd] = {0.};
+const double fsd_P[nfsd] = {1.};
+
+// Energy loss in the source: probability of one inelastic scattering, and loss distribution (in eV)
+const double eloss_p = 0.;
+const double eloss_E = 12.6;
+const double eloss_w = 1.5;
+
+// Systematic priors (gaussian widths)
+const double sig_res = 0.01;	// Relative uncertainty on res
+const double sig_fermi = 1e-3;	// Relative slope across the window: a linear distortion in E, not a variation of the Fermi function itself
+const double sig_fsd_E = 0.01;	// Relative uncertainty on the excitation energies
+const double sig_fsd_w = 0.1;	// Broadening (in eV) of each final-state line
+const double sig_eloss_p = 0.01;	// Uncertainty on the scattering probability
+////////////////// End Of Parameters ///////////////
+
+// Physical Constants
+const double Pi = 3.14159265;	// Pi
+const double alpha = 1./137;	// Structure constant
+const double m_e = 0.510998910e6;	// Mass (in eV) of electron. From Wikipedia.
+const double m_nu= 0.2;	// Mass (in eV) of neutrino. Value was given in our project synopsis
+
+// Spectrum kernels, generic over the scalar type (needs the constants above)
+#include "bdecay_spectrum.h"
+
+// One systematic variation of the spectrum model and detector
+struct Variation {
+	double res;	// Detector resolution
+	double fermi;	// Relative slope added to the Fermi function
+	double fsd_scale;	// Scale of the final-state excitation energies
+	double fsd_w;	// Width of each final-state line
+	double eloss_p;	// Scattering probability
+};
+
+// Functions
+Variation draw_variation(int);
+void expected_spectrum(const Variation&, vector<double>&);
+void normalize(vector<double>&, const vector<double>&);
+
+// Main program
+void bdecay_syst(string filename){
+
+	limit= limit*Q;	// Limit above which we want our spectrum
+	int nth = nthreads>0 ? nthreads : max(1u, thread::hardware_concurrency());
+
+	// Nominal expected spectrum
+	Variation nom = {res, 0., 1., 0., eloss_p};
+	vector<double> mu;
+	expected_spectrum(nom, mu);
+
+	// Variations, computed in parallel. Each thread takes every nth variation
+	cout << "(Computing " << nvariations << " variations on " << nth << " threads...)\n";
+	vector< vector<double> > templ(nvariations);
+	vector<thread> workers;
+	for (int t=0; t<nth; t++) {
+		workers.push_back(thread([&, t]() {
+			for (int v=t; v<nvariations; v+=nth) {
+				expected_spectrum(draw_variation(v), templ[v]);
+				if (shapeonly) normalize(templ[v], mu);
+			}
+		}));
+	}
+	for (int t=0; t<nth; t++) workers[t].join();
+
+	// Covariance matrix around the nominal spectrum, computed in parallel over rows
+	vector<double> V(ndivisions*ndivisions, 0.);
+	workers.clear();
+	for (int t=0; t<nth; t++) {
+		workers.push_back(thread([&, t]() {
+			for (int i=t; i<ndivisions; i+=nth) {
+				for (int v=0; v<nvariations; v++) {
+					double di = templ[v][i]-mu[i];
+					for (int j=0; j<=i; j++) V[i*ndivisions+j] += di*(templ[v][j]-mu[j]);
+				}
+				for (int j=0; j<=i; j++) {
+					V[i*ndivisions+j] /= nvariations;
+					V[j*ndivisions+i] = V[i*ndivisions+j];
+				}
+			}
+		}));
+	}
+	for (int t=0; t<nth; t++) workers[t].join();
+
+	// ROOT Histograms
+	TH1D *E_e_sm_nom = new TH1D("E_e_sm_nom", ";E_{e} [eV];Intensity", ndivisions, limit, Q);	// Nominal expected smeared spectrum
+	TH1D *syst_err = new TH1D("syst_err", ";E_{e} [eV];Fractional systematic error", ndivisions, limit, Q);
+	TH2D *V_syst = new TH2D("V_syst", ";E_{e} [eV];E_{e} [eV]", ndivisions, limit, Q, ndivisions, limit, Q);	// Fractional covariance matrix
+	for (int i=0; i<ndivisions; i++) {
+		E_e_sm_nom->SetBinContent(i+1, mu[i]);
+		if (mu[i] > 0) syst_err->SetBinContent(i+1, sqrt(V[i*ndivisions+i])/mu[i]);
+		for (int j=0; j<ndivisions; j++) {
+			if (mu[i] > 0 && mu[j] > 0) V_syst->SetBinContent(i+1, j+1, V[i*ndivisions+j]/(mu[i]*mu[j]));
+		}
+	}
+
+	// ROOT rootfile (will contain all histograms)
+	TFile *rootfile = new TFile((filename + ".root").c_str(), "recreate");
+	E_e_sm_nom->Write();	// Save histogram into the rootfile
+	syst_err->Write();
+	V_syst->Write();
+	rootfile->Close();
+}
+
+// Variation number v, drawn from the priors. Each variation has its own seed, so the result does not depend on the number of threads
+Variation draw_variation(int v)
+{
+	TRandom3 rand(4357 + v);
+	Variation var;
+	var.res = res*(1 + rand.Gaus(0, sig_res));
+	var.fermi = rand.Gaus(0, sig_fermi);
+	var.fsd_scale = 1 + rand.Gaus(0, sig_fsd_E);
+	var.fsd_w = fabs(rand.Gaus(0, sig_fsd_w));
+	do var.eloss_p = eloss_p + rand.Gaus(0, sig_eloss_p);	// Gaussian prior truncated to a probability: redrawn, not clamped, so no mass piles up at 0
+	while (var.eloss_p < 0 || var.eloss_p > 1);
+	return var;
+}
+
+// Expected smeared spectrum in the E_e_sm bins for one variation (with C=1)
+void expected_spectrum(const Variation &var, vector<double> &mu)
+{
+	const int ngrid = ndivisions*nsub;
+	const double dT = (Q-limit)/ngrid;	// True energy grid spacing
+	const double width = (Q-limit)/ndivisions;	// Histogram bin width
+
+	// Each final-state line is broadened by a gaussian of width fsd_w, sampled on nline points within 2 sigma
+	const int nline = var.fsd_w > 0 ? 9 : 1;
+	double z[9], wz[9], wsum = 0;
+	for (int l=0; l<nline; l++) {
+		z[l] = nline>1 ? -2. + 4.*l/(nline-1) : 0.;
+		wz[l] = exp(-0.5*z[l]*z[l]);
+		wsum += wz[l];
+	}
+
+	// True spectrum on the grid: sum over final states
+	vector<double> s(ngrid, 0.);
+	for (int k=0; k<nfsd; k++) {
+		for (int l=0; l<nline; l++) {
+			double Q_k = Q - var.fsd_scale*fsd_E[k] + var.fsd_w*z[l];	// Endpoint for this final state
+			for (int j=0; j<ngrid; j++) {
+				double T_e = limit + (j+0.5)*dT;
+				s[j] += fsd_P[k]*wz[l]/wsum * N_gen<double>(T_e, m_nu*m_nu, 1., Q_k) * dT;
+			}
+		}
+	}
+	for (int j=0; j<ngrid; j++) {
+		s[j] *= 1 + var.fermi*(limit + (j+0.5)*dT - 0.5*(limit+Q))/(Q-limit);	// Fermi function model distortion
+	}
+
+	// Energy loss: a fraction eloss_p of the electrons loses a gaussian distributed energy
+	if (var.eloss_p > 0) {
+		vector<double> sl(ngrid, 0.);
+		int jmin = int((eloss_E - 4*eloss_w)/dT), jmax = int((eloss_E + 4*eloss_w)/dT)+1;
+		for (int j=0; j<ngrid; j++) {
+			for (int dj=max(jmin,0); dj<=jmax && j+dj<ngrid; dj++) {
+				double x = (dj*dT - eloss_E)/eloss_w;
+				sl[j] += s[j+dj] * exp(-0.5*x*x) * dT/(sqrt(2*Pi)*eloss_w);
+			}
+		}
+		for (int j=0; j<ngrid; j++) s[j] = (1-var.eloss_p)*s[j] + var.eloss_p*sl[j];
+	}
+
+	// Gaussian detector response. Only the bins within 6 sigma of the true energy are touched
+	mu.assign(ndivisions, 0.);
+	int band = int(6*var.res/width) + 1;
+	for (int j=0; j<ngrid; j++) {
+		if (s[j] == 0) continue;
+		double T_e = limit + (j+0.5)*dT;
+		int b = int((T_e-limit)/width);
+		int i0 = max(0, b-band), i1 = min(ndivisions-1, b+band);
+		double cdf_lo = 0.5*erfc(-(limit + i0*width - T_e)/(sqrt(2.)*var.res));
+		for (int i=i0; i<=i1; i++) {
+			double cdf_hi = 0.5*erfc(-(limit + (i+1)*width - T_e)/(sqrt(2.)*var.res));
+			mu[i] += s[j]*(cdf_hi-cdf_lo);
+			cdf_lo = cdf_hi;
+		}
+	}
+}
+
+// Scale the spectrum mu to the integral of the reference spectrum
+void normalize(vector<double> &mu, const vector<double> &ref)
+{
+	double sum = 0, sumref = 0;
+	for (int i=0; i<ndivisions; i++) {
+		sum += mu[i];
+		sumref += ref[i];
+	}
+	for (int i=0; i<ndivisions; i++) mu[i] *= sumref/sum;
+}
@@ -0,0 +1,277 @@
+//********************************************************************
+// Unfolding of the smeared beta decay spectrum
+// Uses a pre-existing beta decay spectrum
+//
+// Recovers the true spectrum from E_e_sm with the gaussian detector
+// response, in the same binning:
+//  - Richardson-Lucy (D'Agostini) iterations, starting from E_e_sm
+//  - Tikhonov regularized least squares, with a curvature penalty tau |D t|^2
+// The migration matrix R(j|i) of a gaussian response on equal bins only
+// depends on j-i and vanishes beyond nsigma*res, so it is stored as a
+// kernel K[j-i] of 2w+1 values. Folding is O(n w) and the Tikhonov normal
+// matrix is banded (half bandwidth 2w), so its Cholesky factor is O(n w^2)
+// and is computed once. The errors come from Poisson bootstrap replicas of
+// E_e_sm, unfolded in parallel. The resolution is that of the generation,
+// and histograms in rates (activity > 0 in bdecay_sim) are unfolded in
+// counts, so that the weights and the replicas have Poisson variances.
+//
+// To run, do <root -l 'bdecay_unfold.cpp("filename")'>
+// Output (in filename_unfold.root): E_e_unf_rl, E_e_unf_tik (bootstrap
+// errors) and the true spectrum E_e for comparison
+//********************************************************************
+
+// C++ libs
+#include <iostream>
+#include<stdlib.h>	//rand, srand
+#include<cmath>
+#include<vector>
+#include<thread>
+
+// ROOT libs
+#include<TH1D.h>
+#include<TFile.h>
+#include<TMath.h>
+#include<TRandom3.h>
+#include<TCanvas.h>
+#include<TStyle.h>
+
+using namespace std;
+
+////////////////// Parameters ///////////////////////
+// Initial nucleus
+const int Z_1 = 1;	// Atomic number of initial nucleus (3H)
+
+// Final nucleus
+const int Z_2 = 2;	// Atomic number of final nucleus (3He)
+
+// Other parameters
+const int charge = -1;
+const double Q = 18590; // Katrin Q Value (in eV), for files without it
+const double res = -1;	// Resolution of detector (in eV) (-1 = that of the generation, read from the file)
+const double nsigma = 6;	// Response kernel cut (in units of res)
+const int nsub = 20;	// Number of true energies averaged per bin for the kernel
+const int niter = 20;	// Number of Richardson-Lucy iterations
+const double tau = 1e-2;	// Tikhonov regularization strength
+const int nboot = 200;	// Number of bootstrap replicas (0 = no errors)
+const int nthreads = 0;	// Number of threads (0 = number of cores)
+////////////////// End Of Parameters ///////////////
+
+// Physical Constants
+const double Pi = 3.14159265;	// Pi
+const double alpha = 1./137;	// Structure constant
+const double m_e = 0.510998910e6;	// Mass (in eV) of electron. From Wikipedia.
+
+// Spectrum kernels, generic over the scalar type (needs the constants above)
+#include "bdecay_spectrum.h"
+#include "bdecay_fit.h"
+
+// Banded response: R(j|i) = K[w + j-i] for |j-i| <= w
+int w;
+vector<double> K;
+vector<double> eff;	// Efficiency of true bin i, sum_j R(j|i) (below 1 at the edges)
+vector<double> Lb;	// Banded Cholesky factor of the Tikhonov normal matrix: L_ik = Lb[i*(2w+1) + i-k]
+vector<double> W;	// Weights 1/variance of the measured bins
+
+// Functions
+void fold(const vector<double>&, vector<double>&);
+void backfold(const vector<double>&, vector<double>&);
+void unfold_rl(const vector<double>&, vector<double>&);
+bool factor_tikhonov(int);
+void unfold_tik(const vector<double>&, vector<double>&);
+
+// Main program
+void bdecay_unfold(string filename){
+	gStyle->SetOptStat(0);
+	int nth = nthreads>0 ? nthreads : max(1u, thread::hardware_concurrency());
+
+	// ROOT rootfile
+	TFile *rootfile = new TFile((filename + ".root").c_str(), "read");
+	TH1D *E_e = (TH1D*)rootfile->Get("E_e");
+	TH1D *E_e_sm = (TH1D*)rootfile->Get("E_e_sm");
+	int n = E_e_sm->GetNbinsX();
+	double lo = E_e_sm->GetXaxis()->GetXmin(), hi = E_e_sm->GetXaxis()->GetXmax(), width = (hi-lo)/n;
+	GenInfo gen = ReadGenInfo(rootfile, Q, lo);
+	double r = res >= 0 ? res : gen.res;
+	if (r <= 0) {
+		cout << filename << ".root has no resolution: set res" << endl;
+		return;
+	}
+	double scale = gen.livetime > 0 ? gen.livetime : 1.;	// Counts per histogram unit
+	cout << "res = " << r << " eV" << (gen.livetime > 0 ? ", unfolded in counts for the live time " + to_string(gen.livetime) + " s" : "") << endl;
+	vector<double> m(n);
+	for (int j=0; j<n; j++) m[j] = gen.Counts(E_e_sm->GetBinContent(j+1));
+
+	// Response kernel: probability for a true energy uniform in a bin to be measured d bins away
+	w = int(nsigma*r/width) + 1;
+	K.assign(2*w+1, 0.);
+	for (int s=0; s<nsub; s++) {
+		double x = (s+0.5)/nsub;	// Position of the true energy in its bin (in bin widths)
+		for (int d=-w; d<=w; d++) {
+			double cdf_lo = 0.5*erfc(-(d - x)*width/(sqrt(2.)*r)), cdf_hi = 0.5*erfc(-(d+1 - x)*width/(sqrt(2.)*r));
+			K[w+d] += (cdf_hi - cdf_lo)/nsub;
+		}
+	}
+	eff.assign(n, 0.);
+	for (int i=0; i<n; i++) {
+		for (int d=-w; d<=w; d++) if (i+d >= 0 && i+d < n) eff[i] += K[w+d];
+	}
+
+	// Tikhonov normal matrix, factorized once (the weights come from the data, not from the replicas)
+	W.assign(n, 0.);
+	for (int j=0; j<n; j++) W[j] = 1./max(m[j], 1.);	// Neyman, on counts
+	if (!factor_tikhonov(n)) {
+		cout << "Tikhonov normal matrix is not positive definite" << endl;
+		return;
+	}
+
+	vector<double> t_rl, t_tik;
+	unfold_rl(m, t_rl);
+	unfold_tik(m, t_tik);
+
+	// Bootstrap: each thread unfolds every nth replica and keeps its own sums
+	vector< vector<double> > sum(nth, vector<double>(4*n, 0.));	// sum and sum of squares, RL then Tikhonov
+	vector<thread> threads;
+	for (int t=0; t<nth; t++) {
+		threads.push_back(thread([&, t]() {
+			vector<double> mb(n), tb;
+			double *s = &sum[t][0];
+			for (int b=t; b<nboot; b+=nth) {
+				TRandom3 rand(4357 + b);	// One seed per replica, so the result does not depend on the number of threads
+				for (int j=0; j<n; j++) mb[j] = rand.Poisson(m[j]);
+				unfold_rl(mb, tb);
+				for (int i=0; i<n; i++) {
+					s[i] += tb[i];
+					s[n+i] += tb[i]*tb[i];
+				}
+				unfold_tik(mb, tb);
+				for (int i=0; i<n; i++) {
+					s[2*n+i] += tb[i];
+					s[3*n+i] += tb[i]*tb[i];
+				}
+			}
+		}));
+	}
+	for (int t=0; t<nth; t++) threads[t].join();
+	for (int t=1; t<nth; t++) for (int i=0; i<4*n; i++) sum[0][i] += sum[t][i];
+
+	// ROOT Histograms, in the units of E_e_sm
+	TH1D *E_e_unf_rl = new TH1D("E_e_unf_rl", "Richardson-Lucy;E_{e} [eV];Intensity", n, lo, hi);
+	TH1D *E_e_unf_tik = new TH1D("E_e_unf_tik", "Tikhonov;E_{e} [eV];Intensity", n, lo, hi);
+	for (int i=0; i<n; i++) {
+		E_e_unf_rl->SetBinContent(i+1, t_rl[i]/scale);
+		E_e_unf_tik->SetBinContent(i+1, t_tik[i]/scale);
+		if (nboot > 1) {
+			double mean = sum[0][i]/nboot, mean2 = sum[0][n+i]/nboot;
+			E_e_unf_rl->SetBinError(i+1, sqrt(max(mean2 - mean*mean, 0.)*nboot/(nboot-1))/scale);
+			mean = sum[0][2*n+i]/nboot;
+			mean2 = sum[0][3*n+i]/nboot;
+			E_e_unf_tik->SetBinError(i+1, sqrt(max(mean2 - mean*mean, 0.)*nboot/(nboot-1))/scale);
+		}
+	}
+
+	// Comparison with the true spectrum
+	if (E_e && E_e->GetNbinsX() == n) {
+		double chi2_rl = 0, chi2_tik = 0;
+		for (int i=1; i<=n; i++) {
+			double e_rl = E_e_unf_rl->GetBinError(i), e_tik = E_e_unf_tik->GetBinError(i);
+			if (e_rl > 0) chi2_rl += pow((E_e_unf_rl->GetBinContent(i) - E_e->GetBinContent(i))/e_rl, 2);
+			if (e_tik > 0) chi2_tik += pow((E_e_unf_tik->GetBinContent(i) - E_e->GetBinContent(i))/e_tik, 2);
+		}
+		cout << "Richardson-Lucy: ChiSq to E_e = " << chi2_rl << " for " << n << " bins" << endl;
+		cout << "Tikhonov:        ChiSq to E_e = " << chi2_tik << " for " << n << " bins" << endl;
+	}
+
+	TCanvas *c1=new TCanvas("E_e_unf","E_e_unf");	// ROOT canvas creation
+	E_e_unf_rl->SetLineColor(2);	// red
+	E_e_unf_rl->Draw();
+	E_e_unf_tik->SetLineColor(4);	// blue
+	E_e_unf_tik->Draw("same");
+
+	TFile *outfile = new TFile((filename + "_unfold.root").c_str(), "recreate");
+	E_e_unf_rl->Write();
+	E_e_unf_tik->Write();
+	if (E_e) E_e->Write();
+	outfile->Close();
+}
+
+// Measured spectrum of the true spectrum t: out_j = sum_i R(j|i) t_i
+void fold(const vector<double> &t, vector<double> &out)
+{
+	int n = t.size();
+	out.assign(n, 0.);
+	for (int d=-w; d<=w; d++) {	// One diagonal at a time: contiguous loop, vectorized by the compiler
+		double k = K[w+d];
+		int j0 = max(0, d), j1 = min(n, n+d);
+		for (int j=j0; j<j1; j++) out[j] += k*t[j-d];
+	}
+}
+
+// Transpose: out_i = sum_j R(j|i) r_j
+void backfold(const vector<double> &r, vector<double> &out)
+{
+	int n = r.size();
+	out.assign(n, 0.);
+	for (int d=-w; d<=w; d++) {
+		double k = K[w+d];
+		int i0 = max(0, -d), i1 = min(n, n-d);
+		for (int i=i0; i<i1; i++) out[i] += k*r[i+d];
+	}
+}
+
+// Richardson-Lucy: t_i <- t_i/eff_i sum_j R(j|i) m_j/(R t)_j, starting from the measured spectrum
+void unfold_rl(const vector<double> &m, vector<double> &t)
+{
+	int n = m.size();
+	t = m;
+	vector<double> pred, corr;
+	for (int it=0; it<niter; it++) {
+		fold(t, pred);
+		for (int j=0; j<n; j++) pred[j] = pred[j] > 0 ? m[j]/pred[j] : 0.;
+		backfold(pred, corr);
+		for (int i=0; i<n; i++) t[i] *= eff[i] > 0 ? corr[i]/eff[i] : 0.;
+	}
+}
+
+// Cholesky factor of A = R^T W R + tau D^T D (D = second differences), stored by rows in the band
+bool factor_tikhonov(int n)
+{
+	int p = 2*w;	// Half bandwidth of A (w >= 1, so it covers D^T D)
+	Lb.assign(n*(p+1), 0.);
+	for (int i=0; i<n; i++) {
+		for (int k=max(0, i-p); k<=i; k++) {
+			// A_ik = sum_j K[j-i] W_j K[j-k] + tau (D^T D)_ik
+			double a = 0;
+			for (int j=max(0, i-w); j<=min(n-1, k+w); j++) a += K[w+j-i]*W[j]*K[w+j-k];
+			for (int l=max(1, i-1); l<=min(n-2, k+1); l++) {	// Rows l of D: t_{l-1} - 2 t_l + t_{l+1}
+				int ci = i-l, ck = k-l;
+				a += tau*(ci == 0 ? -2. : 1.)*(ck == 0 ? -2. : 1.);
+			}
+			for (int l=max(0, i-p); l<k; l++) a -= Lb[i*(p+1)+i-l]*Lb[k*(p+1)+k-l];
+			if (k < i) Lb[i*(p+1)+i-k] = a/Lb[k*(p+1)];
+			else {
+				if (a <= 0) return false;
+				Lb[i*(p+1)] = sqrt(a);
+			}
+		}
+	}
+	return true;
+}
+
+// Tikhonov solution A t = R^T W m, with the factor of factor_tikhonov()
+void unfold_tik(const vector<double> &m, vector<double> &t)
+{
+	int n = m.size(), p = 2*w;
+	vector<double> wm(n), z(n);
+	for (int j=0; j<n; j++) wm[j] = W[j]*m[j];
+	backfold(wm, t);
+	for (int i=0; i<n; i++) {	// L z = b
+		double s = t[i];
+		for (int l=max(0, i-p); l<i; l++) s -= Lb[i*(p+1)+i-l]*z[l];
+		z[i] = s/Lb[i*(p+1)];
+	}
+	for (int i=n-1; i>=0; i--) {	// L^T t = z
+		double s = z[i];
+		for (int l=i+1; l<=min(n-1, i+p); l++) s -= Lb[l*(p+1)+l-i]*t[l];
+		t[i] = s/Lb[i*(p+1)];
+	}
+}